@@ -0,0 +1,113 @@
+/* arena.c - memory arenas for short and long-lived allocations
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* Most of the memory cpio allocates while processing an archive member
+   is only needed until the next member: link targets, directory names,
+   copies of file names.  It is taken from the member arena, which is
+   emptied at the start of each member by member_arena_reset, so that
+   no malloc or free is needed for it once the arena has grown to the
+   size of the largest member.  Temporaries that are released in the
+   reverse order of their allocation may also be given back at once
+   with member_free.
+
+   The records that live until the end of the run, such as those of
+   the inode table, are taken from the record arena, which is never
+   freed.  Their strings are kept apart, so that
+   they need no alignment padding.
+
+   Both arenas are obstacks, and are used by the main thread only.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "cpiohdr.h"
+#include "extern.h"
+#include <obstack.h>
+
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+
+static struct obstack member_obstack;
+static struct obstack record_obstack;
+static struct obstack record_char_obstack;
+static char *member_base;	/* First object of the member arena.  */
+static bool arenas_initialized;
+
+static void
+arenas_init (void)
+{
+  obstack_init (&member_obstack);
+  obstack_init (&record_obstack);
+  obstack_init (&record_char_obstack);
+  obstack_alignment_mask (&record_char_obstack) = 0;
+  member_base = obstack_alloc (&member_obstack, 0);
+  arenas_initialized = true;
+}
+
+/* Allocate SIZE bytes that are needed until the next member.  */
+void *
+member_xmalloc (size_t size)
+{
+  if (!arenas_initialized)
+    arenas_init ();
+  return obstack_alloc (&member_obstack, size);
+}
+
+char *
+member_xstrdup (char const *str)
+{
+  if (!arenas_initialized)
+    arenas_init ();
+  return obstack_copy0 (&member_obstack, str, strlen (str));
+}
+
+/* Free PTR, which was returned by member_xmalloc or member_xstrdup, and
+   everything allocated in the member arena after it.  */
+void
+member_free (void *ptr)
+{
+  obstack_free (&member_obstack, ptr);
+}
+
+/* Free everything allocated in the member arena.  */
+void
+member_arena_reset (void)
+{
+  if (!arenas_initialized)
+    return;
+  obstack_free (&member_obstack, member_base);
+  member_base = obstack_alloc (&member_obstack, 0);
+}
+
+/* Allocate SIZE bytes that are never freed.  */
+void *
+record_xmalloc (size_t size)
+{
+  if (!arenas_initialized)
+    arenas_init ();
+  return obstack_alloc (&record_obstack, size);
+}
+
+/* Allocate N bytes with no alignment that are never freed.  */
+char *
+record_xcharalloc (size_t n)
+{
+  if (!arenas_initialized)
+    arenas_init ();
+  return obstack_alloc (&record_char_obstack, n);
+}
@@ -0,0 +1,1010 @@
+/* compress.c - built-in compression of the archive
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* The compression stage sits between the archive buffers and the
+   archive file.  In copy-out mode, tape_empty_output_buffer hands each
+   block to compress_write, which writes the compressed data in blocks
+   of `io_block_size' bytes.  The last block is not padded, so that the
+   archive can be read by the usual decompression programs.
+
+   In copy-in mode, the first block read from the archive is checked
+   for the magic number of a compressed stream.  If one is found, the
+   archive is decompressed transparently by decompress_read.
+   Concatenated streams are accepted, and so is a padding of zero
+   bytes after the last one.
+
+   With --seekable, the archive is written as a series of independent
+   frames, each starting at a member boundary, followed by a seek table
+   in the format used by the zstd "seekable" tools: a skippable frame
+   listing the compressed and decompressed size of each frame.  When
+   such an archive is read from a regular file, the data of the members
+   that are skipped are not decompressed; decompress_skip seeks to the
+   frame containing the next member instead.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "cpiohdr.h"
+#include "extern.h"
+#include <paxlib.h>
+#include <rmt.h>
+
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+# include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+# include <lz4frame.h>
+#endif
+
+/* Size of the buffer holding compressed data read from the archive.  */
+#define COMPRESS_BUFFER_SIZE (128 * 1024)
+
+struct codec
+  {
+    enum compression type;
+
+    void (*encode_init) (void);
+    /* Prepare for a new stream, once the previous one is done.  */
+    void (*encode_reset) (void);
+    /* Compress at most *IN_LEFT bytes from *IN into at most OUT_SIZE
+       bytes at OUT, advancing *IN and *IN_LEFT.  If FINISH, end the
+       stream, and set *DONE once it is complete.  Return the number of
+       bytes stored at OUT.  */
+    size_t (*encode) (char const **in, size_t *in_left,
+		      char *out, size_t out_size, bool finish, bool *done);
+
+    void (*decode_init) (void);
+    void (*decode_end) (void);
+    /* Decompress data from *IN into at most OUT_SIZE bytes at OUT,
+       advancing *IN and *IN_LEFT.  Set *DONE at the end of the stream.
+       Return the number of bytes stored at OUT.  */
+    size_t (*decode) (char const **in, size_t *in_left,
+		      char *out, size_t out_size, bool *done);
+  };
+
+static void
+corrupt_archive (char const *msg)
+{
+  if (msg)
+    error (PAXEXIT_FAILURE, 0, _("corrupted compressed archive: %s"), msg);
+  error (PAXEXIT_FAILURE, 0, _("corrupted compressed archive"));
+}
+
+static void
+compress_error (char const *msg)
+{
+  if (msg)
+    error (PAXEXIT_FAILURE, 0, _("compression error: %s"), msg);
+  error (PAXEXIT_FAILURE, 0, _("compression error"));
+}
+
+#ifdef HAVE_ZLIB
+static z_stream gz_stream;
+
+static void
+gzip_encode_init (void)
+{
+  if (deflateInit2 (&gz_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    compress_error (gz_stream.msg);
+}
+
+static void
+gzip_encode_reset (void)
+{
+  deflateReset (&gz_stream);
+}
+
+static size_t
+gzip_encode (char const **in, size_t *in_left, char *out, size_t out_size,
+	     bool finish, bool *done)
+{
+  int rc;
+  uInt in_size = *in_left < UINT_MAX ? *in_left : UINT_MAX;
+
+  gz_stream.next_in = (Bytef *) *in;
+  gz_stream.avail_in = in_size;
+  gz_stream.next_out = (Bytef *) out;
+  gz_stream.avail_out = out_size;
+  rc = deflate (&gz_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+  if (rc == Z_STREAM_END)
+    *done = true;
+  else if (rc != Z_OK && rc != Z_BUF_ERROR)
+    compress_error (gz_stream.msg);
+  *in += in_size - gz_stream.avail_in;
+  *in_left -= in_size - gz_stream.avail_in;
+  return out_size - gz_stream.avail_out;
+}
+
+static void
+gzip_decode_init (void)
+{
+  memset (&gz_stream, 0, sizeof gz_stream);
+  if (inflateInit2 (&gz_stream, MAX_WBITS + 16) != Z_OK)
+    corrupt_archive (gz_stream.msg);
+}
+
+static void
+gzip_decode_end (void)
+{
+  inflateEnd (&gz_stream);
+}
+
+static size_t
+gzip_decode (char const **in, size_t *in_left, char *out, size_t out_size,
+	     bool *done)
+{
+  int rc;
+  uInt in_size = *in_left < UINT_MAX ? *in_left : UINT_MAX;
+
+  gz_stream.next_in = (Bytef *) *in;
+  gz_stream.avail_in = in_size;
+  gz_stream.next_out = (Bytef *) out;
+  gz_stream.avail_out = out_size;
+  rc = inflate (&gz_stream, Z_NO_FLUSH);
+  if (rc == Z_STREAM_END)
+    *done = true;
+  else if (rc != Z_OK && rc != Z_BUF_ERROR)
+    corrupt_archive (gz_stream.msg);
+  *in += in_size - gz_stream.avail_in;
+  *in_left -= in_size - gz_stream.avail_in;
+  return out_size - gz_stream.avail_out;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static lzma_stream xz_stream = LZMA_STREAM_INIT;
+
+static void
+xz_check (lzma_ret rc, void (*fail) (char const *))
+{
+  switch (rc)
+    {
+    case LZMA_OK:
+    case LZMA_STREAM_END:
+    case LZMA_BUF_ERROR:
+      break;
+
+    case LZMA_MEM_ERROR:
+      xalloc_die ();
+
+    default:
+      fail (NULL);
+    }
+}
+
+static void
+xz_encode_init (void)
+{
+  lzma_ret rc;
+
+# if LZMA_VERSION >= 50020002
+  if (jobs_option > 1)
+    {
+      lzma_mt mt;
+
+      memset (&mt, 0, sizeof mt);
+      mt.threads = jobs_option;
+      mt.preset = LZMA_PRESET_DEFAULT;
+      mt.check = LZMA_CHECK_CRC64;
+      rc = lzma_stream_encoder_mt (&xz_stream, &mt);
+    }
+  else
+# endif
+    rc = lzma_easy_encoder (&xz_stream, LZMA_PRESET_DEFAULT,
+			    LZMA_CHECK_CRC64);
+  xz_check (rc, compress_error);
+}
+
+static void
+xz_encode_reset (void)
+{
+  lzma_end (&xz_stream);
+  xz_encode_init ();
+}
+
+static size_t
+xz_encode (char const **in, size_t *in_left, char *out, size_t out_size,
+	   bool finish, bool *done)
+{
+  lzma_ret rc;
+
+  xz_stream.next_in = (uint8_t const *) *in;
+  xz_stream.avail_in = *in_left;
+  xz_stream.next_out = (uint8_t *) out;
+  xz_stream.avail_out = out_size;
+  rc = lzma_code (&xz_stream, finish ? LZMA_FINISH : LZMA_RUN);
+  xz_check (rc, compress_error);
+  if (rc == LZMA_STREAM_END)
+    *done = true;
+  *in += *in_left - xz_stream.avail_in;
+  *in_left = xz_stream.avail_in;
+  return out_size - xz_stream.avail_out;
+}
+
+static void
+xz_decode_init (void)
+{
+  lzma_ret rc;
+
+# if LZMA_VERSION >= 50040002
+  if (jobs_option > 1)
+    {
+      lzma_mt mt;
+
+      memset (&mt, 0, sizeof mt);
+      mt.threads = jobs_option;
+      mt.memlimit_threading = lzma_physmem () / 4;
+      mt.memlimit_stop = UINT64_MAX;
+      rc = lzma_stream_decoder_mt (&xz_stream, &mt);
+    }
+  else
+# endif
+    rc = lzma_stream_decoder (&xz_stream, UINT64_MAX, 0);
+  xz_check (rc, corrupt_archive);
+}
+
+static void
+xz_decode_end (void)
+{
+  lzma_end (&xz_stream);
+}
+
+static size_t
+xz_decode (char const **in, size_t *in_left, char *out, size_t out_size,
+	   bool *done)
+{
+  lzma_ret rc;
+
+  xz_stream.next_in = (uint8_t const *) *in;
+  xz_stream.avail_in = *in_left;
+  xz_stream.next_out = (uint8_t *) out;
+  xz_stream.avail_out = out_size;
+  rc = lzma_code (&xz_stream, LZMA_RUN);
+  xz_check (rc, corrupt_archive);
+  if (rc == LZMA_STREAM_END)
+    *done = true;
+  *in += *in_left - xz_stream.avail_in;
+  *in_left = xz_stream.avail_in;
+  return out_size - xz_stream.avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *zstd_cctx;
+static ZSTD_DCtx *zstd_dctx;
+
+static void
+zstd_encode_init (void)
+{
+  zstd_cctx = ZSTD_createCCtx ();
+  if (!zstd_cctx)
+    xalloc_die ();
+  /* This fails if libzstd was built without multithreading support,
+     in which case the compression is just done by this thread.  */
+  if (jobs_option > 1)
+    ZSTD_CCtx_setParameter (zstd_cctx, ZSTD_c_nbWorkers, jobs_option);
+}
+
+static void
+zstd_encode_reset (void)
+{
+  ZSTD_CCtx_reset (zstd_cctx, ZSTD_reset_session_only);
+}
+
+static size_t
+zstd_encode (char const **in, size_t *in_left, char *out, size_t out_size,
+	     bool finish, bool *done)
+{
+  ZSTD_inBuffer input = { *in, *in_left, 0 };
+  ZSTD_outBuffer output = { out, out_size, 0 };
+  size_t rc = ZSTD_compressStream2 (zstd_cctx, &output, &input,
+				    finish ? ZSTD_e_end : ZSTD_e_continue);
+
+  if (ZSTD_isError (rc))
+    compress_error (ZSTD_getErrorName (rc));
+  if (finish && rc == 0)
+    *done = true;
+  *in += input.pos;
+  *in_left -= input.pos;
+  return output.pos;
+}
+
+static void
+zstd_decode_init (void)
+{
+  if (!zstd_dctx)
+    {
+      zstd_dctx = ZSTD_createDCtx ();
+      if (!zstd_dctx)
+	xalloc_die ();
+    }
+  ZSTD_DCtx_reset (zstd_dctx, ZSTD_reset_session_only);
+}
+
+static void
+zstd_decode_end (void)
+{
+}
+
+static size_t
+zstd_decode (char const **in, size_t *in_left, char *out, size_t out_size,
+	     bool *done)
+{
+  ZSTD_inBuffer input = { *in, *in_left, 0 };
+  ZSTD_outBuffer output = { out, out_size, 0 };
+  size_t rc = ZSTD_decompressStream (zstd_dctx, &output, &input);
+
+  if (ZSTD_isError (rc))
+    corrupt_archive (ZSTD_getErrorName (rc));
+  if (rc == 0)
+    *done = true;
+  *in += input.pos;
+  *in_left -= input.pos;
+  return output.pos;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/* The LZ4 frame API needs room for a whole compressed chunk, so the
+   compressed data are staged in a buffer of their own.  */
+# define LZ4_CHUNK_SIZE (64 * 1024)
+
+static LZ4F_cctx *lz4_cctx;
+static LZ4F_dctx *lz4_dctx;
+static char *lz4_stage;
+static size_t lz4_stage_pos;
+static size_t lz4_stage_len;
+static bool lz4_begun;
+static bool lz4_ended;
+
+static void
+lz4_encode_init (void)
+{
+  if (LZ4F_isError (LZ4F_createCompressionContext (&lz4_cctx, LZ4F_VERSION)))
+    xalloc_die ();
+  lz4_stage = xmalloc (LZ4F_compressBound (LZ4_CHUNK_SIZE, NULL)
+		       + LZ4F_HEADER_SIZE_MAX);
+}
+
+static void
+lz4_encode_reset (void)
+{
+  lz4_begun = lz4_ended = false;
+}
+
+static size_t
+lz4_encode (char const **in, size_t *in_left, char *out, size_t out_size,
+	    bool finish, bool *done)
+{
+  size_t rc;
+  size_t n;
+
+  if (lz4_stage_pos == lz4_stage_len)
+    {
+      lz4_stage_pos = lz4_stage_len = 0;
+      if (!lz4_begun)
+	{
+	  rc = LZ4F_compressBegin (lz4_cctx, lz4_stage,
+				   LZ4F_HEADER_SIZE_MAX, NULL);
+	  lz4_begun = true;
+	}
+      else if (*in_left)
+	{
+	  n = *in_left < LZ4_CHUNK_SIZE ? *in_left : LZ4_CHUNK_SIZE;
+	  rc = LZ4F_compressUpdate (lz4_cctx, lz4_stage,
+				    LZ4F_compressBound (n, NULL),
+				    *in, n, NULL);
+	  *in += n;
+	  *in_left -= n;
+	}
+      else if (finish && !lz4_ended)
+	{
+	  rc = LZ4F_compressEnd (lz4_cctx, lz4_stage,
+				 LZ4F_compressBound (0, NULL), NULL);
+	  lz4_ended = true;
+	}
+      else
+	{
+	  *done = lz4_ended;
+	  return 0;
+	}
+      if (LZ4F_isError (rc))
+	compress_error (LZ4F_getErrorName (rc));
+      lz4_stage_len = rc;
+    }
+
+  n = lz4_stage_len - lz4_stage_pos;
+  if (n > out_size)
+    n = out_size;
+  memcpy (out, lz4_stage + lz4_stage_pos, n);
+  lz4_stage_pos += n;
+  if (lz4_ended && lz4_stage_pos == lz4_stage_len)
+    *done = true;
+  return n;
+}
+
+static void
+lz4_decode_init (void)
+{
+  if (LZ4F_isError (LZ4F_createDecompressionContext (&lz4_dctx,
+						      LZ4F_VERSION)))
+    xalloc_die ();
+}
+
+static void
+lz4_decode_end (void)
+{
+  LZ4F_freeDecompressionContext (lz4_dctx);
+  lz4_dctx = NULL;
+}
+
+static size_t
+lz4_decode (char const **in, size_t *in_left, char *out, size_t out_size,
+	    bool *done)
+{
+  size_t out_len = out_size;
+  size_t in_len = *in_left;
+  size_t rc = LZ4F_decompress (lz4_dctx, out, &out_len, *in, &in_len, NULL);
+
+  if (LZ4F_isError (rc))
+    corrupt_archive (LZ4F_getErrorName (rc));
+  if (rc == 0)
+    *done = true;
+  *in += in_len;
+  *in_left -= in_len;
+  return out_len;
+}
+#endif
+
+static struct codec const codecs[] = {
+#ifdef HAVE_ZLIB
+  { compress_gzip,
+    gzip_encode_init, gzip_encode_reset, gzip_encode,
+    gzip_decode_init, gzip_decode_end, gzip_decode },
+#endif
+#ifdef HAVE_LZMA
+  { compress_xz,
+    xz_encode_init, xz_encode_reset, xz_encode,
+    xz_decode_init, xz_decode_end, xz_decode },
+#endif
+#ifdef HAVE_ZSTD
+  { compress_zstd,
+    zstd_encode_init, zstd_encode_reset, zstd_encode,
+    zstd_decode_init, zstd_decode_end, zstd_decode },
+#endif
+#ifdef HAVE_LZ4
+  { compress_lz4,
+    lz4_encode_init, lz4_encode_reset, lz4_encode,
+    lz4_decode_init, lz4_decode_end, lz4_decode },
+#endif
+  { compress_none }
+};
+
+/* All the methods known to --compress, supported or not, and the
+   magic numbers of their streams.  */
+static struct
+{
+  char const *name;
+  enum compression type;
+  unsigned char magic[6];
+  size_t magic_len;
+} const compression_methods[] = {
+  { "gzip", compress_gzip, { 0x1f, 0x8b }, 2 },
+  { "xz",   compress_xz,   { 0xfd, '7', 'z', 'X', 'Z', 0 }, 6 },
+  { "zstd", compress_zstd, { 0x28, 0xb5, 0x2f, 0xfd }, 4 },
+  { "lz4",  compress_lz4,  { 0x04, 0x22, 0x4d, 0x18 }, 4 },
+  { NULL }
+};
+
+static struct codec const *
+find_codec (enum compression type)
+{
+  struct codec const *c;
+
+  for (c = codecs; c->type != compress_none; c++)
+    if (c->type == type)
+      return c;
+  return NULL;
+}
+
+/* Return the compression method named NAME, or compress_none if there
+   is no such method.  */
+enum compression
+find_compression_method (char const *name)
+{
+  size_t i;
+
+  for (i = 0; compression_methods[i].name; i++)
+    if (strcmp (name, compression_methods[i].name) == 0)
+      return compression_methods[i].type;
+  return compress_none;
+}
+
+/* Return true if this build of cpio supports the method TYPE.  */
+bool
+compression_supported (enum compression type)
+{
+  return find_codec (type) != NULL;
+}
+
+/* Seek tables */
+
+/* Magic number of the skippable frame holding the seek table, and of
+   the footer that ends it.  */
+#define SEEK_TABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEK_TABLE_FOOTER_SIZE 9
+/* Bits of the footer descriptor: each entry has a checksum, and bits
+   that must be zero.  */
+#define SEEK_TABLE_CHECKSUM_FLAG 0x80
+#define SEEK_TABLE_RESERVED_BITS 0x7c
+
+/* The sizes in the seek table are 32-bit, so the members larger than
+   this are split into several frames.  */
+#define SEEK_FRAME_MAX (1024 * 1024 * 1024)
+
+static void
+put_le32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t
+get_le32 (unsigned char const *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Compression */
+
+static struct codec const *encoder;
+static char *compress_buffer;	/* Compressed output block.  */
+static size_t compress_size;	/* Number of bytes in it.  */
+
+/* With --seekable, the compressed and decompressed sizes of the frames
+   written so far, and of the current one.  */
+static unsigned char *seek_table;
+static size_t seek_table_size;
+static size_t seek_table_alloc;
+static size_t frame_in;
+static size_t frame_out;
+
+/* Offsets of the member boundaries in the data not yet compressed, in
+   increasing order, and that of the next byte to compress.  */
+static off_t *member_offset;
+static size_t member_head;
+static size_t member_count;
+static size_t member_alloc;
+static off_t compress_offset;
+
+static void
+compress_flush (int out_des)
+{
+  if (compress_size == 0)
+    return;
+  if (archive_raw_write (out_des, compress_buffer, compress_size)
+      != (ssize_t) compress_size)
+    error (PAXEXIT_FAILURE, errno, _("write error"));
+  compress_size = 0;
+}
+
+/* Compress at most *LEFT bytes from *BUF, or end the stream if FINISH,
+   into `compress_buffer', writing it to OUT_DES when it is full.  */
+static bool
+compress_chunk (int out_des, char const **buf, size_t *left, bool finish)
+{
+  bool done = false;
+  size_t n = encoder->encode (buf, left,
+			      compress_buffer + compress_size,
+			      io_block_size - compress_size,
+			      finish, &done);
+
+  compress_size += n;
+  frame_out += n;
+  if (compress_size == io_block_size)
+    compress_flush (out_des);
+  return done;
+}
+
+/* Add the current frame to the seek table and start a new one.  */
+static void
+end_frame (int out_des)
+{
+  char const *buf = NULL;
+  size_t left = 0;
+
+  while (!compress_chunk (out_des, &buf, &left, true))
+    ;
+  if (!seekable_flag)
+    return;
+  if (seek_table_alloc - seek_table_size < 8)
+    seek_table = x2nrealloc (seek_table, &seek_table_alloc, 1);
+  put_le32 (seek_table + seek_table_size, frame_out);
+  put_le32 (seek_table + seek_table_size + 4, frame_in);
+  seek_table_size += 8;
+  frame_in = frame_out = 0;
+}
+
+/* End the current frame and start a new one.  */
+static void
+new_frame (int out_des)
+{
+  end_frame (out_des);
+  encoder->encode_reset ();
+}
+
+/* Copy SIZE bytes of BUF to the compressed output, as they are.  */
+static void
+compress_put (int out_des, unsigned char const *buf, size_t size)
+{
+  while (size > 0)
+    {
+      size_t n = io_block_size - compress_size;
+
+      if (n > size)
+	n = size;
+      memcpy (compress_buffer + compress_size, buf, n);
+      compress_size += n;
+      buf += n;
+      size -= n;
+      if (compress_size == io_block_size)
+	compress_flush (out_des);
+    }
+}
+
+/* Write the seek table of a seekable archive to OUT_DES.  */
+static void
+write_seek_table (int out_des)
+{
+  unsigned char header[8];
+  unsigned char footer[SEEK_TABLE_FOOTER_SIZE];
+
+  put_le32 (header, SEEK_TABLE_MAGIC);
+  put_le32 (header + 4, seek_table_size + SEEK_TABLE_FOOTER_SIZE);
+  put_le32 (footer, seek_table_size / 8);
+  footer[4] = 0;
+  put_le32 (footer + 5, SEEKABLE_MAGIC);
+
+  compress_put (out_des, header, sizeof header);
+  compress_put (out_des, seek_table, seek_table_size);
+  compress_put (out_des, footer, sizeof footer);
+}
+
+/* Compress SIZE bytes of BUF and write them to the archive OUT_DES.
+   Return SIZE.  */
+ssize_t
+compress_write (int out_des, char const *buf, size_t size)
+{
+  size_t left = size;
+
+  if (!encoder)
+    {
+      encoder = find_codec (compress_option);
+      encoder->encode_init ();
+      compress_buffer = xmalloc (io_block_size);
+    }
+
+  while (left > 0)
+    {
+      size_t chunk = left;
+      size_t rest;
+
+      if (seekable_flag)
+	{
+	  for (; member_head < member_count
+		 && member_offset[member_head] == compress_offset;
+	       member_head++)
+	    if (frame_in > 0 && frame_in >= seekable_frame_size)
+	      new_frame (out_des);
+	  if (member_head < member_count
+	      && member_offset[member_head] - compress_offset < chunk)
+	    chunk = member_offset[member_head] - compress_offset;
+	  if (chunk > SEEK_FRAME_MAX - frame_in)
+	    chunk = SEEK_FRAME_MAX - frame_in;
+	}
+      rest = chunk;
+      compress_chunk (out_des, &buf, &rest, false);
+      frame_in += chunk - rest;
+      compress_offset += chunk - rest;
+      left -= chunk - rest;
+      if (seekable_flag && frame_in == SEEK_FRAME_MAX)
+	new_frame (out_des);
+    }
+  return size;
+}
+
+/* Called before each member is written to the archive.  With
+   --seekable, remember where it starts, so that a new frame can be
+   started there once the current one holds at least
+   `seekable_frame_size' bytes.  */
+void
+compress_new_member (void)
+{
+  if (!seekable_flag)
+    return;
+  if (member_head == member_count)
+    member_head = member_count = 0;
+  if (member_count == member_alloc)
+    member_offset = x2nrealloc (member_offset, &member_alloc,
+				sizeof member_offset[0]);
+  member_offset[member_count++] = compress_offset + output_size;
+}
+
+/* Terminate the compressed stream written to OUT_DES.  */
+void
+compress_finish (int out_des)
+{
+  if (!encoder)
+    return;
+  end_frame (out_des);
+  if (seekable_flag)
+    write_seek_table (out_des);
+  compress_flush (out_des);
+}
+
+/* Decompression */
+
+enum decompress_state
+  {
+    decompress_undetected,	/* Nothing read yet.  */
+    decompress_plain,		/* The archive is not compressed.  */
+    decompress_active,		/* Decompressing.  */
+    decompress_finished		/* End of the compressed data.  */
+  };
+
+static enum decompress_state decompress_state;
+static struct codec const *decoder;
+static char *raw_buffer;	/* Compressed data read from the archive.  */
+static char const *raw_ptr;	/* Next byte to decompress in it.  */
+static size_t raw_left;		/* Bytes left to decompress.  */
+static bool stream_done;	/* Between two compressed streams.  */
+static off_t decompress_offset;	/* Decompressed bytes returned so far.  */
+
+/* The frames of a seekable archive: the offset of each frame in the
+   archive file, and that of its data in the decompressed archive.  */
+static off_t *frame_raw_offset;
+static off_t *frame_data_offset;
+static size_t frame_count;
+
+/* If the compressed archive IN_DES ends with a seek table, read it.
+   IN_DES must be a local regular file.  */
+static void
+read_seek_table (int in_des)
+{
+  struct stat st;
+  unsigned char footer[SEEK_TABLE_FOOTER_SIZE];
+  unsigned char *table;
+  size_t count, entry_size, table_size, i;
+  off_t raw = 0, data = 0;
+
+  if (fstat (in_des, &st)
+      || st.st_size < 8 + SEEK_TABLE_FOOTER_SIZE
+      || pread (in_des, footer, sizeof footer, st.st_size - sizeof footer)
+	 != sizeof footer
+      || get_le32 (footer + 5) != SEEKABLE_MAGIC
+      || (footer[4] & SEEK_TABLE_RESERVED_BITS) != 0)
+    return;
+
+  count = get_le32 (footer);
+  entry_size = (footer[4] & SEEK_TABLE_CHECKSUM_FLAG) ? 12 : 8;
+  if (count == 0
+      || (st.st_size - 8 - SEEK_TABLE_FOOTER_SIZE) / entry_size < count)
+    return;
+  table_size = count * entry_size;
+
+  table = xmalloc (8 + table_size);
+  if (pread (in_des, table, 8 + table_size,
+	     st.st_size - SEEK_TABLE_FOOTER_SIZE - table_size - 8)
+      != 8 + table_size
+      || get_le32 (table) != SEEK_TABLE_MAGIC
+      || get_le32 (table + 4) != table_size + SEEK_TABLE_FOOTER_SIZE)
+    {
+      free (table);
+      return;
+    }
+
+  frame_raw_offset = xnmalloc (count, sizeof frame_raw_offset[0]);
+  frame_data_offset = xnmalloc (count, sizeof frame_data_offset[0]);
+  for (i = 0; i < count; i++)
+    {
+      unsigned char const *entry = table + 8 + i * entry_size;
+
+      frame_raw_offset[i] = raw;
+      frame_data_offset[i] = data;
+      raw += get_le32 (entry);
+      data += get_le32 (entry + 4);
+    }
+  free (table);
+
+  /* Ignore a table that does not describe this file.  */
+  if (raw != st.st_size - SEEK_TABLE_FOOTER_SIZE - table_size - 8)
+    {
+      free (frame_raw_offset);
+      free (frame_data_offset);
+      frame_raw_offset = frame_data_offset = NULL;
+      return;
+    }
+  frame_count = count;
+}
+
+/* If the SIZE bytes at BUF start with the magic number of a compressed
+   stream, store its method in *TYPE and return its name.  Otherwise,
+   return NULL.  */
+static char const *
+detect_compression (char const *buf, size_t size, enum compression *type)
+{
+  size_t i;
+
+  for (i = 0; compression_methods[i].name; i++)
+    if (size >= compression_methods[i].magic_len
+	&& memcmp (buf, compression_methods[i].magic,
+		   compression_methods[i].magic_len) == 0)
+      {
+	*type = compression_methods[i].type;
+	return compression_methods[i].name;
+      }
+  return NULL;
+}
+
+/* Return true if the archive being read is compressed.  */
+bool
+archive_decompressing (void)
+{
+  return decompress_state == decompress_active
+	 || decompress_state == decompress_finished;
+}
+
+/* Read at most SIZE bytes of archive data from IN_DES into BUF,
+   decompressing them if needed.  Return the number of bytes read, 0 at
+   end of file, or SAFE_READ_ERROR.  */
+ssize_t
+decompress_read (int in_des, char *buf, size_t size)
+{
+  ssize_t n;
+  size_t produced = 0;
+
+  switch (decompress_state)
+    {
+    case decompress_undetected:
+      {
+	enum compression type;
+	char const *name;
+
+	n = archive_raw_read (in_des, buf, size);
+	if (n <= 0)
+	  return n;
+	name = detect_compression (buf, n, &type);
+	if (!name)
+	  {
+	    decompress_state = decompress_plain;
+	    return n;
+	  }
+	decoder = find_codec (type);
+	if (!decoder)
+	  error (PAXEXIT_FAILURE, 0,
+		 _("archive is compressed with %s, which is not supported"
+		   " by this build of cpio"), name);
+	if (append_flag)
+	  error (PAXEXIT_FAILURE, 0,
+		 _("cannot append to a compressed archive"));
+	raw_buffer = xmalloc (n > COMPRESS_BUFFER_SIZE
+			      ? n : COMPRESS_BUFFER_SIZE);
+	memcpy (raw_buffer, buf, n);
+	raw_ptr = raw_buffer;
+	raw_left = n;
+	if (input_is_seekable && !_isrmt (in_des))
+	  read_seek_table (in_des);
+	decoder->decode_init ();
+	decompress_state = decompress_active;
+      }
+      break;
+
+    case decompress_plain:
+      return archive_raw_read (in_des, buf, size);
+
+    case decompress_active:
+      break;
+
+    case decompress_finished:
+      return 0;
+    }
+
+  while (produced == 0)
+    {
+      if (raw_left == 0)
+	{
+	  n = archive_raw_read (in_des, raw_buffer, COMPRESS_BUFFER_SIZE);
+	  if (n < 0)
+	    return n;
+	  if (n == 0)
+	    {
+	      if (!stream_done)
+		error (PAXEXIT_FAILURE, 0,
+		       _("unexpected end of compressed archive"));
+	      decompress_state = decompress_finished;
+	      return 0;
+	    }
+	  raw_ptr = raw_buffer;
+	  raw_left = n;
+	}
+
+      if (stream_done)
+	{
+	  /* Ignore the padding of the last block.  */
+	  if (*raw_ptr == 0)
+	    {
+	      decompress_state = decompress_finished;
+	      return 0;
+	    }
+	  decoder->decode_end ();
+	  decoder->decode_init ();
+	  stream_done = false;
+	}
+
+      produced = decoder->decode (&raw_ptr, &raw_left, buf, size,
+				  &stream_done);
+    }
+  decompress_offset += produced;
+  return produced;
+}
+
+/* Skip the next NUM_BYTES bytes of the decompressed archive IN_DES, as
+   far as its seek table allows: if they end in a frame after the
+   current one, seek to that frame.  Return the number of bytes still
+   to be skipped by reading them.  */
+off_t
+decompress_skip (int in_des, off_t num_bytes)
+{
+  off_t target = decompress_offset + num_bytes;
+  size_t lo = 0, hi = frame_count;
+
+  if (frame_count == 0 || decompress_state != decompress_active)
+    return num_bytes;
+
+  /* Find the last frame that starts at or before TARGET.  */
+  while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+
+      if (frame_data_offset[mid] <= target)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  if (frame_data_offset[lo] <= decompress_offset)
+    return num_bytes;
+
+  if (lseek (in_des, frame_raw_offset[lo], SEEK_SET) < 0)
+    error (PAXEXIT_FAILURE, errno, _("cannot seek on input"));
+  decoder->decode_end ();
+  decoder->decode_init ();
+  raw_left = 0;
+  stream_done = false;
+  decompress_offset = frame_data_offset[lo];
+  return target - decompress_offset;
+}
@@ -119,7 +119,7 @@ get_link_name (struct cpio_file_stat *file_hdr, int in_file_des)
     }
   else
     {
-      link_name = xmalloc (file_hdr->c_filesize + 1);
+      link_name = member_xmalloc (file_hdr->c_filesize + 1);
       tape_buffered_read (link_name, in_file_des, file_hdr->c_filesize);
       link_name[file_hdr->c_filesize] = '\0';
       tape_skip_padding (in_file_des, file_hdr->c_filesize);
@@ -139,10 +139,7 @@ list_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	    {
 	      char *link_name = get_link_name (file_hdr, in_file_des);
 	      if (link_name)
-		{
-		  long_format (file_hdr, link_name);
-		  free (link_name);
-		}
+		long_format (file_hdr, link_name);
 	    }
 	  else
 	    long_format (file_hdr, file_hdr->c_tar_linkname);
@@ -150,6 +147,15 @@ list_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	}
       else
 #endif
+      if (member_xheader.sparse)
+	{
+	  /* Show the size of the file, holes included.  */
+	  struct cpio_file_stat hdr = *file_hdr;
+
+	  hdr.c_filesize = member_xheader.sparse_size;
+	  long_format (&hdr, NULL);
+	}
+      else
 	long_format (file_hdr, NULL);
     }
   else if (name_end == '\n' && isatty (fileno (stdout)))
@@ -189,6 +195,7 @@ try_existing_file (struct cpio_file_stat* file_hdr, int in_file_des,
   struct stat file_stat;
 
   *existing_dir = false;
+  copyin_jobs_sync (file_hdr->c_name);
   if (lstat (file_hdr->c_name, &file_stat) == 0)
     {
       if (S_ISDIR (file_stat.st_mode)
@@ -270,7 +277,6 @@ create_defered_links (struct cpio_file_stat *file_hdr)
       if ( (d->header.c_ino == ino) && (d->header.c_dev_maj == maj)
 	  && (d->header.c_dev_min == min) )
 	{
-	  struct deferment *d_free;
 	  link_res = link_to_name (d->header.c_name, file_hdr->c_name);
 	  if (link_res < 0)
 	    {
@@ -278,6 +284,8 @@ create_defered_links (struct cpio_file_stat *file_hdr)
 		     quote_n (0, d->header.c_name),
 		     quote_n (1, file_hdr->c_name));
 	    }
+	  struct deferment *d_free;
+	  count_inode_link (ino, maj, min);
 	  if (d_prev != NULL)
 	    d_prev->next = d->next;
 	  else
@@ -331,6 +339,8 @@ create_defered_links_to_skipped (struct cpio_file_stat *file_hdr,
 	  cpio_set_c_name (file_hdr, d->header.c_name);
 	  free_deferment (d);
 	  copyin_regular_file(file_hdr, in_file_des);
+	  /* The skipped link will not be seen again.  */
+	  count_inode_link (ino, maj, min);
 	  return 0;
 	}
       else
@@ -354,6 +364,7 @@ create_final_defers (void)
   struct deferment *d;
   int	link_res;
   int	out_file_des;
+  int	perms;
 
   for (d = deferments; d != NULL; d = d->next)
     {
@@ -365,38 +376,39 @@ create_final_defers (void)
 	 */
       link_res = link_to_maj_min_ino (d->header.c_name,
 		    d->header.c_dev_maj, d->header.c_dev_min,
-		    d->header.c_ino);
+		    d->header.c_ino, d->header.c_nlink);
       if (link_res == 0)
 	{
 	  continue;
 	}
-      out_file_des = open (d->header.c_name,
-			   O_CREAT | O_WRONLY | O_BINARY, 0600);
-      if (out_file_des < 0 && create_dir_flag)
-	{
-	  create_all_directories (d->header.c_name);
-	  out_file_des = open (d->header.c_name,
-			       O_CREAT | O_WRONLY | O_BINARY,
-			       0600);
-	}
+      out_file_des = create_output_file (&d->header, &perms);
       if (out_file_des < 0)
 	{
 	  open_error (d->header.c_name);
 	  continue;
 	}
 
-      set_perms (out_file_des, &d->header);
+      set_output_perms (out_file_des, &d->header, perms);
 
       if (close (out_file_des) < 0)
 	close_error (d->header.c_name);
 
     }
+
+  while (deferments != NULL)
+    {
+      d = deferments;
+      deferments = d->next;
+      free_deferment (d);
+    }
 }
 
 static void
 copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 {
   int out_file_des;		/* Output file descriptor.  */
+  int perms = 0;		/* What set_output_perms has to restore.  */
+  off_t copied;			/* Bytes of data already copied.  */
 
   if (to_stdout_option)
     out_file_des = STDOUT_FILENO;
@@ -422,8 +434,14 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 		 data later, in case the file is readonly.  We still
 		 lose if its parent directory is readonly (and we aren't
 		 running as root), but there's nothing we can do about
-		 that.  */
-	      defer_copyin (file_hdr);
+		 that.  The data may also have come with an earlier
+		 link, as in archives created with --data-first-links,
+		 in which case the link is made at once.  */
+	      char *link_name = find_inode_file (file_hdr->c_ino,
+						 file_hdr->c_dev_maj,
+						 file_hdr->c_dev_min);
+	      if (!link_name || link_to_name (file_hdr->c_name, link_name) < 0)
+		defer_copyin (file_hdr);
 	      tape_toss_input (in_file_des, file_hdr->c_filesize);
 	      tape_skip_padding (in_file_des, file_hdr->c_filesize);
 	      return;
@@ -437,7 +455,7 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	     F. Guilmette to the upstream maintainers. -BEM */
 	  link_res = link_to_maj_min_ino (file_hdr->c_name,
 		    file_hdr->c_dev_maj, file_hdr->c_dev_min,
-					  file_hdr->c_ino);
+					  file_hdr->c_ino, file_hdr->c_nlink);
 	  if (link_res == 0)
 	    {
 	      tape_toss_input (in_file_des, file_hdr->c_filesize);
@@ -455,7 +473,7 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	  link_res = link_to_maj_min_ino (file_hdr->c_name,
 					  file_hdr->c_dev_maj,
 					  file_hdr->c_dev_min,
-					  file_hdr->c_ino);
+					  file_hdr->c_ino, file_hdr->c_nlink);
 	  if (link_res == 0)
 	    {
 	      tape_toss_input (in_file_des, file_hdr->c_filesize);
@@ -479,16 +497,7 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	}
 
       /* If not linked, copy the contents of the file.  */
-      out_file_des = open (file_hdr->c_name,
-			   O_CREAT | O_WRONLY | O_BINARY, 0600);
-
-      if (out_file_des < 0 && create_dir_flag)
-	{
-	  create_all_directories (file_hdr->c_name);
-	  out_file_des = open (file_hdr->c_name,
-			       O_CREAT | O_WRONLY | O_BINARY,
-			       0600);
-	}
+      out_file_des = create_output_file (file_hdr, &perms);
 
       if (out_file_des < 0)
 	{
@@ -497,6 +506,12 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	  tape_skip_padding (in_file_des, file_hdr->c_filesize);
 	  return;
 	}
+
+      /* Blocks of zeros are not written with --sparse, and holes are
+	 not with a sparse map, so they must not be allocated either.  */
+      if (preallocate_flag && !sparse_flag && !member_xheader.sparse)
+	preallocate_output (out_file_des, file_hdr->c_name,
+			    file_hdr->c_filesize);
     }
 
   crc = 0;
@@ -516,31 +531,53 @@ copyin_regular_file (struct cpio_file_stat* file_hdr, int in_file_des)
 	error (0, 0, _("cannot swap bytes of %s: odd number of bytes"),
 	       quote (file_hdr->c_name));
     }
-  copy_files_tape_to_disk (in_file_des, out_file_des, file_hdr->c_filesize);
-  disk_empty_output_buffer (out_file_des, true);
-
-  if (to_stdout_option)
+  /* Data that start on a block boundary of a local archive may be
+     cloned rather than copied, which is quicker than handing them over
+     to a worker thread.  The holes of sparse members are made here
+     too.  */
+  if (member_xheader.sparse)
+    {
+      copy_sparse_tape_to_disk (in_file_des, out_file_des, &member_xheader);
+      copied = file_hdr->c_filesize;
+    }
+  else
+    copied = clone_to_disk (in_file_des, out_file_des, file_hdr->c_filesize);
+  if (copied == 0
+      && copyin_jobs_submit (file_hdr, in_file_des, out_file_des, perms))
+    {
+      /* A worker thread copies the data.  Permissions, checksum and
+	 closing the file are taken care of when the job completes.  */
+    }
+  else
     {
+      copy_files_tape_to_disk (in_file_des, out_file_des,
+			       file_hdr->c_filesize - copied);
+      disk_empty_output_buffer (out_file_des, true);
+
+      if (to_stdout_option)
+	{
+	  if (archive_format == arf_crcascii)
+	    {
+	      if (crc != file_hdr->c_chksum)
+		error (0, 0, _("%s: checksum error (0x%x, should be 0x%x)"),
+		       quote (file_hdr->c_name), crc, file_hdr->c_chksum);
+	    }
+	  tape_skip_padding (in_file_des, file_hdr->c_filesize);
+	  return;
+	}
+
+      drop_file_cache (out_file_des, file_hdr->c_filesize, true);
+      set_output_perms (out_file_des, file_hdr, perms);
+
+      if (close (out_file_des) < 0)
+	close_error (file_hdr->c_name);
+
       if (archive_format == arf_crcascii)
 	{
 	  if (crc != file_hdr->c_chksum)
 	    error (0, 0, _("%s: checksum error (0x%x, should be 0x%x)"),
 		   quote (file_hdr->c_name), crc, file_hdr->c_chksum);
 	}
-      tape_skip_padding (in_file_des, file_hdr->c_filesize);
-      return;
-    }
-
-  set_perms (out_file_des, file_hdr);
-
-  if (close (out_file_des) < 0)
-    close_error (file_hdr->c_name);
-
-  if (archive_format == arf_crcascii)
-    {
-      if (crc != file_hdr->c_chksum)
-	error (0, 0, _("%s: checksum error (0x%x, should be 0x%x)"),
-	       quote (file_hdr->c_name), crc, file_hdr->c_chksum);
     }
 
   tape_skip_padding (in_file_des, file_hdr->c_filesize);
@@ -572,7 +609,7 @@ copyin_device (struct cpio_file_stat* file_hdr)
 	 "bug-gnu-utils@prep.ai.mit.edu". (99/1/6) -BEM */
       link_res = link_to_maj_min_ino (file_hdr->c_name,
 		    file_hdr->c_dev_maj, file_hdr->c_dev_min,
-		    file_hdr->c_ino);
+		    file_hdr->c_ino, file_hdr->c_nlink);
       if (link_res == 0)
 	{
 	  return;
@@ -613,20 +650,8 @@ copyin_device (struct cpio_file_stat* file_hdr)
       mknod_error (file_hdr->c_name);
       return;
     }
-  if (!no_chown_flag)
-    {
-      uid_t uid = set_owner_flag ? set_owner : file_hdr->c_uid;
-      gid_t gid = set_group_flag ? set_group : file_hdr->c_gid;
-      if ((chown (file_hdr->c_name, uid, gid) < 0)
-	  && errno != EPERM)
-	chown_error_details (file_hdr->c_name, uid, gid);
-    }
-  /* chown may have turned off some permissions we wanted. */
-  if (chmod (file_hdr->c_name, file_hdr->c_mode) < 0)
-    chmod_error_details (file_hdr->c_name, file_hdr->c_mode);
-  if (retain_time_flag)
-    set_file_times (-1, file_hdr->c_name, file_hdr->c_mtime,
-		    file_hdr->c_mtime, 0);
+  /* mknod applies the umask, which is 0 here.  */
+  set_output_perms (-1, file_hdr, output_perms (-1, file_hdr));
 }
 
 struct delayed_link
@@ -793,7 +818,7 @@ copyin_link (struct cpio_file_stat *file_hdr, int in_file_des)
     {
       if (to_stdout_option)
 	return;
-      link_name = xstrdup (file_hdr->c_tar_linkname);
+      link_name = member_xstrdup (file_hdr->c_tar_linkname);
     }
 
   if (no_abs_paths_flag)
@@ -821,7 +846,6 @@ copyin_link (struct cpio_file_stat *file_hdr, int in_file_des)
 	set_file_times (-1, file_hdr->c_name, file_hdr->c_mtime,
 			file_hdr->c_mtime, AT_SYMLINK_NOFOLLOW);
     }
-  free (link_name);
 }
 
 static void
@@ -915,30 +939,36 @@ long_format (struct cpio_file_stat *file_hdr, char const *link_name)
 
   when = file_hdr->c_mtime;
   when_timespec.tv_sec = when;
-  when_timespec.tv_nsec = 0;
+  when_timespec.tv_nsec = file_hdr->c_mtime_nsec;
 
-  /* Get time values ready to print.  Do not worry about ctime failing,
-     or a year outside the range 1000-9999, since 0 <= WHEN < 2**33.  */
+  /* Get time values ready to print.  The time of a member that has an
+     extended header may be out of the range of ctime, or of the years
+     1000-9999; print it as a number of seconds then.  */
   tbuf = ctime (&when);
-
-  /* If the file appears to be in the future, update the current
-     time, in case the file happens to have been modified since
-     the last time we checked the clock.  */
-  if (timespec_cmp (current_time, when_timespec) < 0)
-    current_time = current_timespec ();
-
-  /* Consider a time to be recent if it is within the past six months.
-     Use the same algorithm that GNU 'ls' does, for consistency. */
-  if (!(timespec_cmp (six_months_ago, when_timespec) < 0
-	&& timespec_cmp (when_timespec, current_time) < 0))
+  if (!tbuf || strlen (tbuf) != sizeof "Thu Jan  1 00:00:00 1970\n" - 1)
+    printf ("%12jd ", (intmax_t) when);
+  else
     {
-      /* The file is older than 6 months, or in the future.
-	 Show the year instead of the time of day.  */
-      memcpy (tbuf + 11, tbuf + 19, sizeof " 1970" - 1);
+      /* If the file appears to be in the future, update the current
+	 time, in case the file happens to have been modified since
+	 the last time we checked the clock.  */
+      if (timespec_cmp (current_time, when_timespec) < 0)
+	current_time = current_timespec ();
+
+      /* Consider a time to be recent if it is within the past six
+	 months.  Use the same algorithm that GNU 'ls' does, for
+	 consistency. */
+      if (!(timespec_cmp (six_months_ago, when_timespec) < 0
+	    && timespec_cmp (when_timespec, current_time) < 0))
+	{
+	  /* The file is older than 6 months, or in the future.
+	     Show the year instead of the time of day.  */
+	  memcpy (tbuf + 11, tbuf + 19, sizeof " 1970" - 1);
+	}
+      tbuf[16] = ' ';
+      tbuf[17] = '\0';
+      printf ("%s", tbuf + 4);
     }
-  tbuf[16] = ' ';
-  tbuf[17] = '\0';
-  printf ("%s", tbuf + 4);
 
   printf ("%s", quotearg (file_hdr->c_name));
   if (link_name)
@@ -994,6 +1024,62 @@ read_pattern_file (void)
   num_patterns = new_num_patterns;
 }
 
+/* Return true if NAME is selected by the patterns given on the command
+   line or with -E.  */
+
+static bool
+name_selected (char const *name)
+{
+  bool selected;
+  int i;
+
+  if (num_patterns <= 0)
+    return true;
+  selected = !copy_matching_files;
+  for (i = 0; i < num_patterns && selected != copy_matching_files; i++)
+    {
+      if (fnmatch (save_patterns[i], name, 0) == 0)
+	selected = copy_matching_files;
+    }
+  return selected;
+}
+
+/* Remove the files listed in the deletions member FILE_HDR of an
+   incremental archive (see incremental.c).  */
+
+static void
+copyin_deletions (struct cpio_file_stat *file_hdr, int in_file_des)
+{
+  char *names, *p, *end;
+  struct stat st;
+
+  names = xmalloc (file_hdr->c_filesize + 1);
+  tape_buffered_read (names, in_file_des, file_hdr->c_filesize);
+  tape_skip_padding (in_file_des, file_hdr->c_filesize);
+  names[file_hdr->c_filesize] = '\0';
+  end = names + file_hdr->c_filesize;
+
+  for (p = names; p < end; p += strlen (p) + 1)
+    {
+      if (!*p)
+	continue;
+      cpio_safer_name_suffix (p, false, !no_abs_paths_flag, false);
+      if (!name_selected (p))
+	continue;
+      copyin_jobs_sync (p);
+      if (lstat (p, &st))
+	continue;
+      if (S_ISDIR (st.st_mode) ? rmdir (p) : unlink (p))
+	{
+	  if (errno != ENOENT)
+	    error (0, errno, _("cannot remove %s"), quote (p));
+	}
+      else if (verbose_flag)
+	fprintf (stderr, _("Removed %s\n"), quotearg (p));
+    }
+  free (names);
+}
+
 
 uintmax_t
 from_ascii (char const *where, size_t digs, unsigned logbase)
@@ -1056,6 +1142,9 @@ read_in_header (struct cpio_file_stat *file_hdr, int in_des)
   } magic;
   long bytes_skipped = 0;	/* Bytes of junk found before magic number.  */
 
+  /* Only extended headers carry nanoseconds.  */
+  file_hdr->c_mtime_nsec = 0;
+
   /* Search for a valid magic number.  */
 
   if (archive_format == arf_unknown)
@@ -1246,6 +1335,56 @@ read_in_old_ascii (struct cpio_file_stat *file_hdr, int in_des)
     }
 }
 
+/* If the member FILE_HDR, named CPIO_EXTENDED_NAME, is an extended
+   header, read its data from IN_DES into `member_xheader' and return
+   true.  It must be a regular file whose data start with
+   CPIO_EXTENDED_SIGNATURE and decode completely.  Otherwise, the member
+   may be a file of that name: leave its data to be read as those of an
+   ordinary member and return false.  */
+
+static bool
+read_in_xheader (struct cpio_file_stat *file_hdr, int in_des)
+{
+  char sig[sizeof CPIO_EXTENDED_SIGNATURE - 1];
+  off_t size = file_hdr->c_filesize;
+  char *buf;
+  uint32_t sum = 0;
+  off_t i;
+
+  /* Look at the start of the data before reading them, and do not trust
+     the archive with the size to allocate.  */
+  if ((file_hdr->c_mode & CP_IFMT) != CP_IFREG
+      || size < (off_t) sizeof sig || size > XHEADER_MAX_SIZE
+      || tape_buffered_peek (sig, in_des, sizeof sig) != sizeof sig
+      || memcmp (sig, CPIO_EXTENDED_SIGNATURE, sizeof sig) != 0)
+    return false;
+
+  /* xheader_decode modifies the data: decode a copy of them, and keep
+     the original to be read again if they are not an extended
+     header.  */
+  buf = xmalloc (2 * size);
+  tape_buffered_read (buf, in_des, size);
+  memcpy (buf + size, buf, size);
+  if (!xheader_decode (&member_xheader, buf + size, size))
+    {
+      xheader_free (&member_xheader);
+      tape_buffered_unread (buf, size);
+      free (buf);
+      return false;
+    }
+  tape_skip_padding (in_des, size);
+  if (archive_format == arf_crcascii)
+    {
+      for (i = 0; i < size; i++)
+	sum += buf[i] & 0xff;
+      if (sum != file_hdr->c_chksum)
+	error (0, 0, _("%s: checksum error (0x%x, should be 0x%x)"),
+	       quote (file_hdr->c_name), sum, file_hdr->c_chksum);
+    }
+  free (buf);
+  return true;
+}
+
 /* Fill in FILE_HDR by reading a new-format ASCII format cpio header from
    file descriptor IN_DES, except for the magic number, which is
    already filled in.  */
@@ -1276,6 +1415,15 @@ read_in_new_ascii (struct cpio_file_stat *file_hdr, int in_des)
      is rounded up to the next long-word, so we might need to drop
      1-3 bytes.  */
   tape_skip_padding (in_des, file_hdr->c_namesize + 110);
+
+  /* An extended header holds attributes of the next member, which is
+     read in its place.  */
+  if (strcmp (file_hdr->c_name, CPIO_EXTENDED_NAME) == 0
+      && read_in_xheader (file_hdr, in_des))
+    {
+      read_in_header (file_hdr, in_des);
+      xheader_apply (&member_xheader, file_hdr);
+    }
 }
 
 /* Fill in FILE_HDR by reading a binary format cpio header from
@@ -1390,7 +1538,6 @@ process_copy_in (void)
 				/* Output header information.  */
   int in_file_des;		/* Input file descriptor.  */
   char skip_file;		/* Flag for use with patterns.  */
-  int i;			/* Loop index variable.  */
 
   newdir_umask = umask (0);     /* Reset umask to preserve modes of
 				   created files  */
@@ -1450,9 +1597,13 @@ process_copy_in (void)
 
   change_dir ();
 
+  copyin_jobs_init (in_file_des);
+
   /* While there is more input in the collection, process the input.  */
   while (1)
     {
+      member_arena_reset ();
+      xheader_free (&member_xheader);
       swapping_halfwords = swapping_bytes = false;
 
       /* Start processing the next file by reading the header.  */
@@ -1487,22 +1638,22 @@ process_copy_in (void)
 	  if (strcmp (CPIO_TRAILER_NAME, file_hdr.c_name) == 0)
 	    break;
 
+	  /* Is this the list of the files deleted since the previous
+	     incremental archive?  Without --incremental, it is an
+	     ordinary member.  */
+	  if (incremental_flag && !table_flag && !append_flag
+	      && !only_verify_crc_flag
+	      && strcmp (CPIO_DELETIONS_NAME, file_hdr.c_name) == 0)
+	    {
+	      copyin_deletions (&file_hdr, in_file_des);
+	      continue;
+	    }
+
 	  cpio_safer_name_suffix (file_hdr.c_name, false, !no_abs_paths_flag,
 				  false);
 
 	  /* Does the file name match one of the given patterns?  */
-	  if (num_patterns <= 0)
-	    skip_file = false;
-	  else
-	    {
-	      skip_file = copy_matching_files;
-	      for (i = 0; i < num_patterns
-		     && skip_file == copy_matching_files; i++)
-		{
-		  if (fnmatch (save_patterns[i], file_hdr.c_name, 0) == 0)
-		    skip_file = !copy_matching_files;
-		}
-	    }
+	  skip_file = !name_selected (file_hdr.c_name);
 	}
 
       if (skip_file)
@@ -1594,6 +1745,7 @@ process_copy_in (void)
   if (dot_flag)
     fputc ('\n', stderr);
 
+  copyin_jobs_finish ();
   replace_symlink_placeholders ();
   apply_delayed_set_stat ();
 
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include "filetypes.h"
 #include "cpiohdr.h"
 #include "dstring.h"
@@ -97,7 +98,8 @@ tape_pad_output (int out_file_des, int offset)
    all of them (or until we get to the end of the list of files that
    are going into the archive and know that we have seen all of the links
    to the file that we will see).  We keep these "defered" files on
-   this list.   */
+   this list.  With --data-first-links, the data is stored with the
+   first link instead, and nothing is defered.  */
 
 struct deferment *deferouts = NULL;
 
@@ -140,6 +142,7 @@ add_link_defer (struct cpio_file_stat *file_hdr)
 {
   struct deferment *d;
   d = create_deferment (file_hdr);
+  d->snapshot = incremental_file_defer ();
   d->next = deferouts;
   deferouts = d;
 }
@@ -170,7 +173,8 @@ writeout_other_defers (struct cpio_file_stat *file_hdr, int out_des)
 	{
 	  struct deferment *d_free;
 	  d->header.c_filesize = 0;
-	  write_out_header (&d->header, out_des);
+	  if (write_out_header (&d->header, out_des) == 0)
+	    incremental_deferred_file_stored (d->snapshot);
 	  if (d_prev != NULL)
 	    d_prev->next = d->next;
 	  else
@@ -193,8 +197,9 @@ writeout_other_defers (struct cpio_file_stat *file_hdr, int out_des)
    for writeout_final_defers() to call.  */
 
 static void
-writeout_defered_file (struct cpio_file_stat *header, int out_file_des)
+writeout_defered_file (struct deferment *d, int out_file_des)
 {
+  struct cpio_file_stat *header = &d->header;
   int in_file_des;
   struct cpio_file_stat file_hdr;
 
@@ -208,6 +213,7 @@ writeout_defered_file (struct cpio_file_stat *header, int out_file_des)
       open_error (header->c_name);
       return;
     }
+  advise_sequential (in_file_des);
 
   if (archive_format == arf_crcascii)
     file_hdr.c_chksum = read_for_checksum (in_file_des,
@@ -218,11 +224,12 @@ writeout_defered_file (struct cpio_file_stat *header, int out_file_des)
     return;
   copy_files_disk_to_tape (in_file_des, out_file_des, file_hdr.c_filesize,
 			   header->c_name);
+  drop_file_cache (in_file_des, file_hdr.c_filesize, false);
   warn_if_file_changed(header->c_name, file_hdr.c_filesize, file_hdr.c_mtime);
 
   if (archive_format == arf_tar || archive_format == arf_ustar)
     add_inode (file_hdr.c_ino, file_hdr.c_name, file_hdr.c_dev_maj,
-	       file_hdr.c_dev_min);
+	       file_hdr.c_dev_min, file_hdr.c_nlink);
 
   tape_pad_output (out_file_des, file_hdr.c_filesize);
 
@@ -231,6 +238,7 @@ writeout_defered_file (struct cpio_file_stat *header, int out_file_des)
 		    file_hdr.c_mtime, 0);
   if (close (in_file_des) < 0)
     close_error (header->c_name);
+  incremental_deferred_file_stored (d->snapshot);
 }
 
 /* When writing newc and crc format archives we defer multiply linked
@@ -250,19 +258,114 @@ writeout_final_defers (int out_des)
       other_count = count_defered_links_to_dev_ino (&d->header);
       if (other_count == 1)
 	{
-	  writeout_defered_file (&d->header, out_des);
+	  writeout_defered_file (d, out_des);
 	}
       else
 	{
 	  struct cpio_file_stat file_hdr;
 	  file_hdr = d->header;
 	  file_hdr.c_filesize = 0;
-	  write_out_header (&file_hdr, out_des);
+	  if (write_out_header (&file_hdr, out_des) == 0)
+	    incremental_deferred_file_stored (d->snapshot);
 	}
       deferouts = deferouts->next;
+      free_deferment (d);
     }
 }
 
+/* With --listed-incremental, write the list of the files deleted
+   since the previous archive to OUT_FILE_DES.  */
+
+static void
+write_out_deletions (int out_file_des)
+{
+  struct cpio_file_stat file_hdr = CPIO_FILE_STAT_INITIALIZER;
+  size_t size;
+  char *names = incremental_deletions (&size);
+
+  if (!names)
+    return;
+
+  file_hdr.c_magic = 070707;
+  file_hdr.c_mode = CP_IFREG | 0600;
+  file_hdr.c_nlink = 1;
+  file_hdr.c_mtime = time (NULL);
+  file_hdr.c_filesize = size;
+  if (archive_format == arf_crcascii)
+    {
+      size_t i;
+
+      for (i = 0; i < size; i++)
+	file_hdr.c_chksum += names[i] & 0xff;
+    }
+  cpio_set_c_name (&file_hdr, CPIO_DELETIONS_NAME);
+  if (write_out_header (&file_hdr, out_file_des) == 0)
+    {
+      tape_buffered_write (names, out_file_des, size);
+      tape_pad_output (out_file_des, size);
+    }
+  cpio_file_stat_free (&file_hdr);
+  free (names);
+}
+
+int write_out_new_ascii_header (const char *magic_string,
+				struct cpio_file_stat *file_hdr,
+				int out_des, bool xheader);
+
+/* Write the extended header holding the attributes of XH to
+   OUT_FILE_DES, right before the header of the member they belong
+   to.  */
+static void
+write_out_xheader (struct xheader const *xh, int out_file_des)
+{
+  struct cpio_file_stat file_hdr = CPIO_FILE_STAT_INITIALIZER;
+  size_t size;
+  char *buf = xheader_encode (xh, &size);
+
+  file_hdr.c_magic = 070707;
+  file_hdr.c_mode = CP_IFREG | 0600;
+  file_hdr.c_nlink = 1;
+  file_hdr.c_mtime = time (NULL);
+  file_hdr.c_filesize = size;
+  if (archive_format == arf_crcascii)
+    {
+      size_t i;
+
+      for (i = 0; i < size; i++)
+	file_hdr.c_chksum += buf[i] & 0xff;
+    }
+  cpio_set_c_name (&file_hdr, CPIO_EXTENDED_NAME);
+  if (write_out_new_ascii_header (archive_format == arf_crcascii
+				  ? "070702" : "070701",
+				  &file_hdr, out_file_des, true) == 0)
+    {
+      tape_buffered_write (buf, out_file_des, size);
+      tape_pad_output (out_file_des, size);
+    }
+  cpio_file_stat_free (&file_hdr);
+  free (buf);
+}
+
+/* Return the checksum of the data of the sparse file FILE_NAME, open
+   as IN_FILE_DES and mapped by XH.  */
+static uint32_t
+read_sparse_for_checksum (int in_file_des, struct xheader const *xh,
+			  char *file_name)
+{
+  uint32_t crc = 0;
+  size_t i;
+
+  for (i = 0; i < xh->sparse_count; i++)
+    {
+      if (lseek (in_file_des, xh->sparse_map[i].offset, SEEK_SET) < 0)
+	error (PAXEXIT_FAILURE, errno, _("cannot read checksum for %s"),
+	       quote (file_name));
+      crc += read_for_checksum (in_file_des, xh->sparse_map[i].size,
+				file_name);
+    }
+  return crc;
+}
+
 /* FIXME: to_ascii could be used instead of to_oct() and to_octal() from tar,
    so it should be moved to paxutils too.
    Allowed values for logbase are: 1 (binary), 2, 3 (octal), 4 (hex) */
@@ -325,16 +428,53 @@ to_ascii_or_error (char *where, uintmax_t n, size_t digits,
 }
 
 
+/* Extended header of the member whose header is written next, set by
+   process_copy_out for the sparse files stored with --sparse-map.  */
+static struct xheader const *next_xheader;
+
+/* Write the newc or crc header of FILE_HDR, starting with MAGIC_STRING,
+   to OUT_DES.  XHEADER is true if FILE_HDR is an extended header, to
+   which --data-align does not apply.  */
 int
 write_out_new_ascii_header (const char *magic_string,
-			    struct cpio_file_stat *file_hdr, int out_des)
+			    struct cpio_file_stat *file_hdr, int out_des,
+			    bool xheader)
 {
   char ascii_header[110];
   char *p;
+  size_t namesize = file_hdr->c_namesize;
+  uintmax_t max = MAX_VAL_WITH_DIGITS (8, LG_16);
+  struct xheader xh = { 0 };
+
+  /* The sparse map stays with the caller; only the numbers below are
+     added to the copy.  */
+  if (next_xheader)
+    {
+      xh = *next_xheader;
+      next_xheader = NULL;
+    }
+
+  /* With --extended-headers, numbers that do not fit in the header go
+     to an extended header.  The inode number matters only for telling
+     the links of a file.  Otherwise, they are truncated with a warning,
+     or the member is not stored if it is its size.  */
+  xh.has_size = extended_headers_flag && file_hdr->c_filesize > max;
+  xh.size = file_hdr->c_filesize;
+  xh.has_ino = (extended_headers_flag && file_hdr->c_nlink > 1
+		&& file_hdr->c_ino > max);
+  xh.ino = file_hdr->c_ino;
+  xh.has_mtime = ((extended_headers_flag
+		   && (file_hdr->c_mtime < 0 || file_hdr->c_mtime > max))
+		  || (nanoseconds_flag && file_hdr->c_mtime_nsec));
+  xh.mtime = file_hdr->c_mtime;
+  xh.mtime_nsec = nanoseconds_flag ? file_hdr->c_mtime_nsec : 0;
 
   p = stpcpy (ascii_header, magic_string);
-  to_ascii_or_warn (p, file_hdr->c_ino, 8, LG_16,
-		    file_hdr->c_name, _("inode number"));
+  if (xh.has_ino)
+    to_ascii (p, file_hdr->c_ino, 8, LG_16, false);
+  else
+    to_ascii_or_warn (p, file_hdr->c_ino, 8, LG_16,
+		      file_hdr->c_name, _("inode number"));
   p += 8;
   to_ascii_or_warn (p, file_hdr->c_mode, 8, LG_16, file_hdr->c_name,
 		    _("file mode"));
@@ -348,11 +488,16 @@ write_out_new_ascii_header (const char *magic_string,
   to_ascii_or_warn (p, file_hdr->c_nlink, 8, LG_16, file_hdr->c_name,
 		    _("number of links"));
   p += 8;
-  to_ascii_or_warn (p, file_hdr->c_mtime, 8, LG_16, file_hdr->c_name,
-		    _("modification time"));
+  if (xh.has_mtime)
+    to_ascii (p, file_hdr->c_mtime, 8, LG_16, false);
+  else
+    to_ascii_or_warn (p, file_hdr->c_mtime, 8, LG_16, file_hdr->c_name,
+		      _("modification time"));
   p += 8;
-  if (to_ascii_or_error (p, file_hdr->c_filesize, 8, LG_16, file_hdr->c_name,
-			 _("file size")))
+  if (xh.has_size)
+    to_ascii (p, 0, 8, LG_16, false);
+  else if (to_ascii_or_error (p, file_hdr->c_filesize, 8, LG_16,
+			      file_hdr->c_name, _("file size")))
     return 1;
   p += 8;
   if (to_ascii_or_error (p, file_hdr->c_dev_maj, 8, LG_16, file_hdr->c_name,
@@ -371,7 +516,24 @@ write_out_new_ascii_header (const char *magic_string,
 			 _("rdev minor")))
     return 1;
   p += 8;
-  if (to_ascii_or_error (p, file_hdr->c_namesize, 8, LG_16, file_hdr->c_name,
+
+  /* Nothing has been written yet: the extended header goes right
+     before the header it completes.  */
+  if (xh.sparse || xh.has_size || xh.has_ino || xh.has_mtime)
+    write_out_xheader (&xh, out_des);
+
+  /* With --data-align, pad the name with NULs so that the data start
+     on a multiple of `data_align_option'.  The archive offset of the
+     header is always a multiple of 4.  */
+  if (data_align_option && !xheader
+      && (file_hdr->c_mode & CP_IFMT) == CP_IFREG
+      && file_hdr->c_filesize > 0)
+    {
+      off_t data = tape_output_offset () + sizeof ascii_header + namesize;
+      namesize += (data_align_option - data % data_align_option)
+		  % data_align_option;
+    }
+  if (to_ascii_or_error (p, namesize, 8, LG_16, file_hdr->c_name,
 			 _("name size")))
     return 1;
   p += 8;
@@ -381,7 +543,9 @@ write_out_new_ascii_header (const char *magic_string,
 
   /* Write file name to output.  */
   tape_buffered_write (file_hdr->c_name, out_des, (long) file_hdr->c_namesize);
-  tape_pad_output (out_des, file_hdr->c_namesize + sizeof ascii_header);
+  write_nuls_to_file (namesize - file_hdr->c_namesize, out_des,
+		      tape_buffered_write);
+  tape_pad_output (out_des, namesize + sizeof ascii_header);
   return 0;
 }
 
@@ -536,13 +700,15 @@ write_out_header (struct cpio_file_stat *file_hdr, int out_des)
   dev_t dev;
   dev_t rdev;
 
+  compress_new_member ();
+
   switch (archive_format)
     {
     case arf_newascii:
-      return write_out_new_ascii_header ("070701", file_hdr, out_des);
+      return write_out_new_ascii_header ("070701", file_hdr, out_des, false);
 
     case arf_crcascii:
-      return write_out_new_ascii_header ("070702", file_hdr, out_des);
+      return write_out_new_ascii_header ("070702", file_hdr, out_des, false);
 
     case arf_oldascii:
       return write_out_old_ascii_header (makedev (file_hdr->c_dev_maj,
@@ -579,14 +745,6 @@ write_out_header (struct cpio_file_stat *file_hdr, int out_des)
     }
 }
 
-static void
-assign_string (char **pvar, char *value)
-{
-  char *p = xrealloc (*pvar, strlen (value) + 1);
-  strcpy (p, value);
-  *pvar = p;
-}
-
 /* Read a list of file names from the standard input
    and write a cpio collection on the standard output.
    The format of the header depends on the compatibility (-c) flag.  */
@@ -601,7 +759,8 @@ process_copy_out (void)
 				/* Output header information.  */
   int in_file_des;		/* Source file descriptor.  */
   int out_file_des;		/* Output file descriptor.  */
-  char *orig_file_name = NULL;
+  char *orig_file_name;
+  struct xheader xheader = { 0 }; /* Extended header of the member.  */
 
   /* Initialize the copy out.  */
   file_hdr.c_magic = 070707;
@@ -625,6 +784,9 @@ process_copy_out (void)
       output_is_seekable = S_ISREG (file_stat.st_mode);
     }
 
+  if (listed_incremental_option)
+    incremental_init ();
+
   if (append_flag)
     {
       process_copy_in ();
@@ -634,8 +796,10 @@ process_copy_out (void)
     change_dir ();
 
   /* Copy files with names read from stdin.  */
-  while (ds_fgetstr (stdin, &input_name, name_end) != NULL)
+  while (get_next_file_name (&input_name) != NULL)
     {
+      member_arena_reset ();
+
       /* Check for blank line.  */
       if (input_name.ds_string[0] == 0)
 	{
@@ -644,10 +808,15 @@ process_copy_out (void)
 	}
 
       /* Process next file.  */
-      if ((*xstat) (input_name.ds_string, &file_stat) < 0)
+      if (stat_input_file (input_name.ds_string, &file_stat) < 0)
 	stat_error (input_name.ds_string);
+      else if (!incremental_file_changed (input_name.ds_string, &file_stat))
+	continue;
       else
 	{
+	  if (dedup_flag)
+	    dedup_stat (&file_stat);
+
 	  /* Set values in output header.  */
 	  stat_to_cpio (&file_hdr, &file_stat);
 
@@ -661,7 +830,7 @@ process_copy_out (void)
 		}
 	    }
 
-	  assign_string (&orig_file_name, input_name.ds_string);
+	  orig_file_name = member_xstrdup (input_name.ds_string);
 	  cpio_safer_name_suffix (input_name.ds_string, false,
 				  !no_abs_paths_flag, true);
 	  cpio_set_c_name (&file_hdr, input_name.ds_string);
@@ -670,7 +839,8 @@ process_copy_out (void)
 	  switch (file_hdr.c_mode & CP_IFMT)
 	    {
 	    case CP_IFREG:
-	      if (archive_format == arf_tar || archive_format == arf_ustar)
+	      if ((archive_format == arf_tar || archive_format == arf_ustar)
+		  && file_hdr.c_nlink > 1)
 		{
 		  char *otherfile;
 		  if ((otherfile = find_inode_file (file_hdr.c_ino,
@@ -684,7 +854,25 @@ process_copy_out (void)
 		    }
 		}
 	      if ( (archive_format == arf_newascii || archive_format == arf_crcascii)
-		  && (file_hdr.c_nlink > 1) )
+		  && (file_hdr.c_nlink > 1) && data_first_links_flag)
+		{
+		  /* Attach the data to the first link stored, and store
+		     the others with a size of 0.  The header may hold
+		     renumbered inode and device numbers: look the file up
+		     by its own.  */
+		  if (find_inode_file (file_stat.st_ino,
+				       major (file_stat.st_dev),
+				       minor (file_stat.st_dev)))
+		    {
+		      file_hdr.c_filesize = 0;
+		      if (write_out_header (&file_hdr, out_file_des))
+			continue;
+		      break;
+		    }
+		}
+	      else if ( (archive_format == arf_newascii
+			 || archive_format == arf_crcascii)
+		       && (file_hdr.c_nlink > 1) )
 		{
 		  if (last_link (&file_hdr) )
 		    {
@@ -703,25 +891,55 @@ process_copy_out (void)
 		  open_error (orig_file_name);
 		  continue;
 		}
+	      advise_sequential (in_file_des);
 
-	      if (archive_format == arf_crcascii)
-		file_hdr.c_chksum = read_for_checksum (in_file_des,
-						       file_hdr.c_filesize,
-						       orig_file_name);
+	      /* Store only the data of a sparse file, which the extended
+		 header maps back to their place.  */
+	      if (sparse_map_flag
+		  && sparse_map_file (in_file_des, orig_file_name, &file_stat,
+				      &xheader))
+		file_hdr.c_filesize = sparse_data_size (&xheader);
 
+	      if (archive_format == arf_crcascii)
+		file_hdr.c_chksum = (xheader.sparse
+				     ? read_sparse_for_checksum (in_file_des,
+								 &xheader,
+								 orig_file_name)
+				     : read_for_checksum (in_file_des,
+							  file_hdr.c_filesize,
+							  orig_file_name));
+
+	      if (xheader.sparse)
+		next_xheader = &xheader;
 	      if (write_out_header (&file_hdr, out_file_des))
-		continue;
-	      copy_files_disk_to_tape (in_file_des,
-				       out_file_des, file_hdr.c_filesize,
-				       orig_file_name);
-	      warn_if_file_changed(orig_file_name, file_hdr.c_filesize,
+		{
+		  xheader_free (&xheader);
+		  continue;
+		}
+	      if (xheader.sparse)
+		copy_sparse_disk_to_tape (in_file_des, out_file_des,
+					  &xheader, orig_file_name);
+	      else
+		copy_files_disk_to_tape (in_file_des,
+					 out_file_des, file_hdr.c_filesize,
+					 orig_file_name);
+	      drop_file_cache (in_file_des, file_stat.st_size, false);
+	      warn_if_file_changed(orig_file_name, file_stat.st_size,
 				   file_hdr.c_mtime);
 
-	      if (archive_format == arf_tar || archive_format == arf_ustar)
+	      if ((archive_format == arf_tar || archive_format == arf_ustar)
+		  && file_hdr.c_nlink > 1)
 		add_inode (file_hdr.c_ino, orig_file_name, file_hdr.c_dev_maj,
-			   file_hdr.c_dev_min);
+			   file_hdr.c_dev_min, file_hdr.c_nlink);
+	      else if (data_first_links_flag && file_hdr.c_nlink > 1)
+		/* Only now that the data is stored can the other links
+		   point to it.  */
+		add_inode (file_stat.st_ino, orig_file_name,
+			   major (file_stat.st_dev), minor (file_stat.st_dev),
+			   file_hdr.c_nlink);
 
 	      tape_pad_output (out_file_des, file_hdr.c_filesize);
+	      xheader_free (&xheader);
 
 	      if (reset_time_flag)
 		set_file_times (in_file_des,
@@ -753,7 +971,7 @@ process_copy_out (void)
 			 quote (orig_file_name));
 		  continue;
 		}
-	      else if (archive_format == arf_ustar)
+	      else if (archive_format == arf_ustar && file_hdr.c_nlink > 1)
 		{
 		  char *otherfile;
 		  if ((otherfile = find_inode_file (file_hdr.c_ino,
@@ -770,7 +988,8 @@ process_copy_out (void)
 		      break;
 		    }
 		  add_inode (file_hdr.c_ino, orig_file_name,
-			     file_hdr.c_dev_maj, file_hdr.c_dev_min);
+			     file_hdr.c_dev_maj, file_hdr.c_dev_min,
+			     file_hdr.c_nlink);
 		}
 	      file_hdr.c_filesize = 0;
 	      if (write_out_header (&file_hdr, out_file_des))
@@ -780,7 +999,7 @@ process_copy_out (void)
 #ifdef CP_IFLNK
 	    case CP_IFLNK:
 	      {
-		char *link_name = (char *) xmalloc (file_stat.st_size + 1);
+		char *link_name = member_xmalloc (file_stat.st_size + 1);
 		int link_size;
 
 		link_size = readlink (orig_file_name, link_name,
@@ -788,7 +1007,6 @@ process_copy_out (void)
 		if (link_size < 0)
 		  {
 		    readlink_warn (orig_file_name);
-		    free (link_name);
 		    continue;
 		  }
 		link_name[link_size] = 0;
@@ -802,6 +1020,7 @@ process_copy_out (void)
 		      {
 			error (0, 0, _("%s: symbolic link too long"),
 			       quote (file_hdr.c_name));
+			continue;
 		      }
 		    else
 		      {
@@ -818,15 +1037,16 @@ process_copy_out (void)
 		    tape_buffered_write (link_name, out_file_des, link_size);
 		    tape_pad_output (out_file_des, link_size);
 		  }
-		free (link_name);
 	      }
 	      break;
 #endif
 
 	    default:
 	      error (0, 0, _("%s: unknown file type"), quote (orig_file_name));
+	      continue;
 	    }
 
+	  incremental_file_stored ();
 	  if (verbose_flag)
 	    fprintf (stderr, "%s\n", quote (orig_file_name));
 	  if (dot_flag)
@@ -834,9 +1054,9 @@ process_copy_out (void)
 	}
     }
 
-  free (orig_file_name);
-
   writeout_final_defers(out_file_des);
+  if (listed_incremental_option)
+    write_out_deletions (out_file_des);
   /* The collection is complete; append the trailer.  */
   file_hdr.c_ino = 0;
   file_hdr.c_mode = 0;
@@ -848,6 +1068,7 @@ process_copy_out (void)
   file_hdr.c_rdev_maj = 0;
   file_hdr.c_rdev_min = 0;
   file_hdr.c_mtime = 0;
+  file_hdr.c_mtime_nsec = 0;
   file_hdr.c_chksum = 0;
 
   file_hdr.c_filesize = 0;
@@ -860,6 +1081,9 @@ process_copy_out (void)
   /* Fill up the output block.  */
   tape_clear_rest_of_block (out_file_des);
   tape_empty_output_buffer (out_file_des);
+  compress_finish (out_file_des);
+  if (listed_incremental_option)
+    incremental_finish ();
   if (dot_flag)
     fputc ('\n', stderr);
   if (!quiet_flag)
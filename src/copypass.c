@@ -32,14 +32,15 @@
 #endif
 
 
-/* A wrapper around set_perms using another set of arguments */
+/* A wrapper around set_output_perms using another set of arguments,
+   for a file NAME just created after ST.  */
 static void
 set_copypass_perms (int fd, const char *name, struct stat *st)
 {
   struct cpio_file_stat header;
   header.c_name = (char*)name;
   stat_to_cpio (&header, st);
-  set_perms (fd, &header);
+  set_output_perms (fd, &header, output_perms (fd, &header));
 }
 
 /* Copy files listed on the standard input into directory `directory_name'.
@@ -59,6 +60,8 @@ process_copy_pass (void)
   struct stat out_file_stat;	/* Stat record for output file.  */
   int in_file_des;		/* Input file descriptor.  */
   int out_file_des;		/* Output file descriptor.  */
+  struct cpio_file_stat out_hdr; /* Header describing the output file.  */
+  int perms;			/* What set_output_perms has to restore.  */
   int existing_dir;		/* True if file is a dir & already exists.  */
 
   newdir_umask = umask (0);     /* Reset umask to preserve modes of
@@ -82,10 +85,12 @@ process_copy_pass (void)
   change_dir ();
 
   /* Copy files with names read from stdin.  */
-  while (ds_fgetstr (stdin, &input_name, name_end) != NULL)
+  while (get_next_file_name (&input_name) != NULL)
     {
       int link_res = -1;
 
+      member_arena_reset ();
+
       /* Check for blank line and ignore it if found.  */
       if (input_name.ds_string[0] == '\0')
 	{
@@ -100,7 +105,7 @@ process_copy_pass (void)
 		  && input_name.ds_string[2] == '\0')))
 	continue;
 
-      if ((*xstat) (input_name.ds_string, &in_file_stat) < 0)
+      if (stat_input_file (input_name.ds_string, &in_file_stat) < 0)
 	{
 	  stat_error (input_name.ds_string);
 	  continue;
@@ -154,7 +159,7 @@ process_copy_pass (void)
 	    link_res = link_to_maj_min_ino (output_name.ds_string,
 				major (in_file_stat.st_dev),
 				minor (in_file_stat.st_dev),
-				in_file_stat.st_ino);
+				in_file_stat.st_ino, in_file_stat.st_nlink);
 
 	  /* If the file was not linked, copy contents of file.  */
 	  if (link_res < 0)
@@ -166,26 +171,26 @@ process_copy_pass (void)
 		  open_error (input_name.ds_string);
 		  continue;
 		}
-	      out_file_des = open (output_name.ds_string,
-				   O_CREAT | O_WRONLY | O_BINARY, 0600);
-	      if (out_file_des < 0 && create_dir_flag)
-		{
-		  create_all_directories (output_name.ds_string);
-		  out_file_des = open (output_name.ds_string,
-				       O_CREAT | O_WRONLY | O_BINARY, 0600);
-		}
+	      advise_sequential (in_file_des);
+	      out_hdr.c_name = output_name.ds_string;
+	      stat_to_cpio (&out_hdr, &in_file_stat);
+	      out_file_des = create_output_file (&out_hdr, &perms);
 	      if (out_file_des < 0)
 		{
 		  open_error (output_name.ds_string);
 		  close (in_file_des);
 		  continue;
 		}
+	      if (preallocate_flag && !sparse_flag)
+		preallocate_output (out_file_des, output_name.ds_string,
+				    in_file_stat.st_size);
 
 	      copy_files_disk_to_disk (in_file_des, out_file_des, in_file_stat.st_size, input_name.ds_string);
 	      disk_empty_output_buffer (out_file_des, true);
+	      drop_file_cache (in_file_des, in_file_stat.st_size, false);
+	      drop_file_cache (out_file_des, in_file_stat.st_size, true);
 
-	      set_copypass_perms (out_file_des,
-				  output_name.ds_string, &in_file_stat);
+	      set_output_perms (out_file_des, &out_hdr, perms);
 
 	      if (reset_time_flag)
 		{
@@ -239,7 +244,7 @@ process_copy_pass (void)
 	    link_res = link_to_maj_min_ino (output_name.ds_string,
 			major (in_file_stat.st_dev),
 			minor (in_file_stat.st_dev),
-			in_file_stat.st_ino);
+			in_file_stat.st_ino, in_file_stat.st_nlink);
 
 	  if (link_res < 0)
 	    {
@@ -265,14 +270,13 @@ process_copy_pass (void)
 	{
 	  char *link_name;
 	  int link_size;
-	  link_name = (char *) xmalloc ((unsigned int) in_file_stat.st_size + 1);
+	  link_name = member_xmalloc (in_file_stat.st_size + 1);
 
 	  link_size = readlink (input_name.ds_string, link_name,
 				in_file_stat.st_size);
 	  if (link_size < 0)
 	    {
 	      readlink_error (input_name.ds_string);
-	      free (link_name);
 	      continue;
 	    }
 	  link_name[link_size] = '\0';
@@ -288,7 +292,6 @@ process_copy_pass (void)
 	  if (res < 0)
 	    {
 	      symlink_error (output_name.ds_string, link_name);
-	      free (link_name);
 	      continue;
 	    }
 
@@ -306,7 +309,6 @@ process_copy_pass (void)
 	    set_file_times (-1, output_name.ds_string,
 			    in_file_stat.st_atime, in_file_stat.st_mtime,
 			    AT_SYMLINK_NOFOLLOW);
-	  free (link_name);
 	}
 #endif
       else
@@ -339,17 +341,18 @@ process_copy_pass (void)
   ds_free (&output_name);
 }
 
-/* Try and create a hard link from FILE_NAME to another file
-   with the given major/minor device number and inode.  If no other
-   file with the same major/minor/inode numbers is known, add this file
-   to the list of known files and associated major/minor/inode numbers
-   and return -1.  If another file with the same major/minor/inode
-   numbers is found, try and create another link to it using
-   link_to_name, and return 0 for success and -1 for failure.  */
+/* Try and create a hard link from FILE_NAME to another file with the
+   given major/minor device number and inode.  If no other file with the
+   same major/minor/inode numbers is known, add this file, which has
+   NLINK links, to the list of known files and associated
+   major/minor/inode numbers and return -1.  If another file with the
+   same major/minor/inode numbers is found, try and create another link
+   to it using link_to_name, and return 0 for success and -1 for
+   failure.  */
 
 int
 link_to_maj_min_ino (char *file_name, int st_dev_maj, int st_dev_min,
-		     ino_t st_ino)
+		     ino_t st_ino, size_t nlink)
 {
   int	link_res;
   char *link_name;
@@ -361,7 +364,7 @@ link_to_maj_min_ino (char *file_name, int st_dev_maj, int st_dev_min,
   if (link_name == NULL)
     add_inode (st_ino, file_name,
 	       st_dev_maj,
-	       st_dev_min);
+	       st_dev_min, nlink);
   else
     link_res = link_to_name (file_name, link_name);
   return link_res;
@@ -27,6 +27,37 @@
 
 #define CPIO_TRAILER_NAME "TRAILER!!!"
 
+/* In an incremental archive, a regular file named "DELETIONS!!!"
+   before the trailer lists the files deleted since the previous one,
+   each name being terminated by a NUL.  */
+
+#define CPIO_DELETIONS_NAME "DELETIONS!!!"
+
+/* In newc and crc archives, a regular file named "EXTENDED!!!" holds
+   attributes of the next member that its header cannot represent, as
+   lines of the form "KEYWORD=VALUE".  The first line is
+   CPIO_EXTENDED_SIGNATURE.  Unknown keywords are ignored.  The numbers
+   are in decimal.  The keywords are:
+
+   size		The size of the member data, if it does not fit in
+		the header, where it is then 0.
+   ino		The inode number of a file with several links, if it
+		does not fit in the header.
+   mtime	The modification time, as seconds since the Epoch
+		followed by a period and the nanoseconds, if any.
+   sparse.size	The size of a sparse file.  The member holds only
+		its data, which are laid out as given by:
+   sparse.map	The offset and size of each extent of data of the
+		file, separated by commas.  The rest of the file is
+		holes.
+
+   An extended header is at most 16 MiB long.  A member with this name
+   that is not a regular file, or whose data are not an extended header
+   as described here, is an ordinary member.  */
+
+#define CPIO_EXTENDED_NAME "EXTENDED!!!"
+#define CPIO_EXTENDED_SIGNATURE "cpio.extended=1\n"
+
 /* All the fields in the header are ISO 646 (approximately ASCII) strings
    of octal numbers, left padded, not NUL terminated.
 
@@ -116,6 +116,7 @@ struct cpio_file_stat /* Internal representation of a CPIO header */
   gid_t c_gid;
   size_t c_nlink;
   time_t c_mtime;
+  long c_mtime_nsec;
   off_t c_filesize;
   unsigned RETTYPE_MAJOR c_dev_maj;
   unsigned RETTYPE_MINOR c_dev_min;
@@ -129,7 +130,32 @@ struct cpio_file_stat /* Internal representation of a CPIO header */
 };
 
 #define CPIO_FILE_STAT_INITIALIZER \
-  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0, NULL }
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0, NULL }
+
+struct sparse_extent		/* Extent of data of a sparse file */
+{
+  off_t offset;
+  off_t size;
+};
+
+struct xheader /* Attributes held by an extended header (see cpio.h) */
+{
+  bool has_size;		/* True if SIZE is set, and so on.  */
+  off_t size;
+  bool has_ino;
+  uintmax_t ino;
+  bool has_mtime;
+  time_t mtime;
+  long mtime_nsec;
+  bool sparse;			/* True if the member is a sparse file.  */
+  off_t sparse_size;		/* Its size, holes included.  */
+  size_t sparse_count;		/* Number of its extents of data.  */
+  struct sparse_extent *sparse_map; /* Its extents of data, in order.  */
+};
+
+/* Size of the largest extended header.  */
+#define XHEADER_MAX_SIZE (16 * 1024 * 1024)
+
 void cpio_file_stat_init (struct cpio_file_stat *file_hdr);
 void cpio_file_stat_free (struct cpio_file_stat *file_hdr);
 void cpio_set_c_name(struct cpio_file_stat *file_hdr, char *name);
@@ -0,0 +1,333 @@
+/* dedup.c - detection of files with identical contents
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* With --dedup, copy-out mode reads the whole list of files before
+   writing anything.  The regular files that have the same size, mode,
+   owner and modification time as another file of the list are hashed,
+   and those found to have the same contents are made to look like hard
+   links to the first of them: dedup_stat gives them the device and
+   inode numbers of that file, and a link count equal to the number of
+   their names in the list.  The usual handling of hard links then
+   stores their data only once: as a link entry in tar and ustar
+   archives, and attached to the last link in newc and crc archives.
+
+   These files are extracted with the attributes of the first of them,
+   which is why all of those attributes must match.  Most files have a
+   size of their own, so they are never read.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "cpiohdr.h"
+#include "dstring.h"
+#include "extern.h"
+#include <hash.h>
+#include <safe-read.h>
+#include <sha256.h>
+#include <stat-time.h>
+#include <timespec.h>
+
+/* A regular file of the list.  */
+struct dedup_file
+{
+  off_t size;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec mtime;
+  dev_t dev;
+  ino_t ino;
+  size_t order;			/* Index of its first name in the list.  */
+  size_t names;			/* Number of its names in the list.  */
+  bool hashed;			/* True if DIGEST is valid.  */
+  unsigned char digest[SHA256_DIGEST_SIZE];
+};
+
+/* A file stored as a link to another one with the same contents.  */
+struct dedup_link
+{
+  dev_t dev;			/* The file.  */
+  ino_t ino;
+  dev_t first_dev;		/* The first file with the same contents.  */
+  ino_t first_ino;
+  nlink_t nlink;		/* Number of names with these contents.  */
+};
+
+/* The names read from the list, and the next one to return.  */
+static char **name_list;
+static size_t name_count;
+static size_t name_alloc;
+static size_t name_next;
+static bool name_list_read;
+
+static Hash_table *link_table;
+
+static size_t
+dedup_link_hasher (void const *data, size_t n_buckets)
+{
+  struct dedup_link const *l = data;
+  return (l->ino ^ l->dev) % n_buckets;
+}
+
+static bool
+dedup_link_compare (void const *a, void const *b)
+{
+  struct dedup_link const *la = a;
+  struct dedup_link const *lb = b;
+  return la->ino == lb->ino && la->dev == lb->dev;
+}
+
+/* Order files by the attributes that must match for their contents to
+   be compared, then by inode, so that the names of a file are
+   adjacent.  */
+static int
+dedup_file_compare (void const *a, void const *b)
+{
+  struct dedup_file const *fa = a;
+  struct dedup_file const *fb = b;
+  int rc;
+
+  if (fa->size != fb->size)
+    return fa->size < fb->size ? -1 : 1;
+  if (fa->mode != fb->mode)
+    return fa->mode < fb->mode ? -1 : 1;
+  if (fa->uid != fb->uid)
+    return fa->uid < fb->uid ? -1 : 1;
+  if (fa->gid != fb->gid)
+    return fa->gid < fb->gid ? -1 : 1;
+  if ((rc = timespec_cmp (fa->mtime, fb->mtime)) != 0)
+    return rc;
+  if (fa->dev != fb->dev)
+    return fa->dev < fb->dev ? -1 : 1;
+  if (fa->ino != fb->ino)
+    return fa->ino < fb->ino ? -1 : 1;
+  return fa->order < fb->order ? -1 : fa->order > fb->order;
+}
+
+/* Order files by contents, then by their place in the list.  Files
+   that could not be hashed come last.  */
+static int
+dedup_digest_compare (void const *a, void const *b)
+{
+  struct dedup_file const *fa = a;
+  struct dedup_file const *fb = b;
+  int rc;
+
+  if (fa->hashed != fb->hashed)
+    return fa->hashed ? -1 : 1;
+  if (fa->hashed
+      && (rc = memcmp (fa->digest, fb->digest, sizeof fa->digest)) != 0)
+    return rc;
+  return fa->order < fb->order ? -1 : fa->order > fb->order;
+}
+
+static bool
+same_group (struct dedup_file const *a, struct dedup_file const *b)
+{
+  return a->size == b->size && a->mode == b->mode
+	 && a->uid == b->uid && a->gid == b->gid
+	 && timespec_cmp (a->mtime, b->mtime) == 0;
+}
+
+/* Compute the digest of the contents of FILE, whose name is NAME.  */
+static void
+hash_file (struct dedup_file *file, char const *name)
+{
+  static char buf[64 * 1024];
+  struct sha256_ctx ctx;
+  size_t n;
+  int fd;
+
+  fd = open (name, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return;
+  advise_sequential (fd);
+  sha256_init_ctx (&ctx);
+  while ((n = safe_read (fd, buf, sizeof buf)) != 0
+	 && n != SAFE_READ_ERROR)
+    sha256_process_bytes (buf, n, &ctx);
+  close (fd);
+  if (n == 0)
+    {
+      sha256_finish_ctx (&ctx, file->digest);
+      file->hashed = true;
+    }
+}
+
+/* Store the files of GROUP, which have the same contents, as links
+   to the first of them.  */
+static void
+add_links (struct dedup_file *group, size_t count)
+{
+  nlink_t nlink = 0;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    nlink += group[i].names;
+
+  if (!link_table)
+    {
+      link_table = hash_initialize (0, NULL, dedup_link_hasher,
+				    dedup_link_compare, free);
+      if (!link_table)
+	xalloc_die ();
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      struct dedup_link *l = xmalloc (sizeof *l);
+
+      l->dev = group[i].dev;
+      l->ino = group[i].ino;
+      l->first_dev = group[0].dev;
+      l->first_ino = group[0].ino;
+      l->nlink = nlink;
+      if (!hash_insert (link_table, l))
+	xalloc_die ();
+    }
+}
+
+/* Find the files with identical contents among the COUNT files of
+   RUN, which have the same size, mode, owner and modification time.  */
+static void
+dedup_run (struct dedup_file *run, size_t count)
+{
+  size_t i, j;
+
+  for (i = 0; i < count; i++)
+    hash_file (&run[i], name_list[run[i].order]);
+  qsort (run, count, sizeof run[0], dedup_digest_compare);
+
+  for (i = 0; i < count && run[i].hashed; i = j)
+    {
+      for (j = i + 1; j < count && run[j].hashed
+	     && memcmp (run[i].digest, run[j].digest,
+			sizeof run[i].digest) == 0;
+	   j++)
+	;
+      if (j - i > 1)
+	add_links (run + i, j - i);
+    }
+}
+
+/* Read the list of files, and find those that have the same
+   contents.  Their status is not kept for stat_input_file, since the
+   whole list is read.  */
+static void
+read_name_list (void)
+{
+  dynamic_string name = DYNAMIC_STRING_INITIALIZER;
+  struct dedup_file *files = NULL;
+  size_t file_count = 0;
+  size_t file_alloc = 0;
+  size_t i, j;
+
+  while (read_input_name (&name))
+    {
+      struct stat st;
+
+      if (name_count == name_alloc)
+	name_list = x2nrealloc (name_list, &name_alloc, sizeof name_list[0]);
+      name_list[name_count] = xstrdup (name.ds_string);
+
+      if (name.ds_string[0]
+	  && stat_input_file (name.ds_string, &st) == 0
+	  && S_ISREG (st.st_mode) && st.st_size > 0)
+	{
+	  struct dedup_file *f;
+
+	  if (file_count == file_alloc)
+	    files = x2nrealloc (files, &file_alloc, sizeof files[0]);
+	  f = &files[file_count++];
+	  f->size = st.st_size;
+	  f->mode = st.st_mode;
+	  f->uid = st.st_uid;
+	  f->gid = st.st_gid;
+	  f->mtime = get_stat_mtime (&st);
+	  f->dev = st.st_dev;
+	  f->ino = st.st_ino;
+	  f->order = name_count;
+	  f->names = 1;
+	  f->hashed = false;
+	}
+      name_count++;
+    }
+  ds_free (&name);
+
+  /* Merge the names of each file.  */
+  qsort (files, file_count, sizeof files[0], dedup_file_compare);
+  for (i = j = 0; i < file_count; i++)
+    {
+      if (j > 0 && files[j - 1].dev == files[i].dev
+	  && files[j - 1].ino == files[i].ino)
+	files[j - 1].names++;
+      else
+	files[j++] = files[i];
+    }
+  file_count = j;
+
+  for (i = 0; i < file_count; i = j)
+    {
+      for (j = i + 1; j < file_count && same_group (&files[i], &files[j]);
+	   j++)
+	;
+      if (j - i > 1)
+	dedup_run (files + i, j - i);
+    }
+  free (files);
+}
+
+/* Get the next name from the list of files into NAME.  Return NULL at
+   the end of the list.  */
+char *
+dedup_next_name (dynamic_string *name)
+{
+  if (!name_list_read)
+    {
+      read_name_list ();
+      name_list_read = true;
+    }
+  if (name_next == name_count)
+    return NULL;
+  ds_reset (name, 0);
+  ds_concat (name, name_list[name_next]);
+  free (name_list[name_next]);
+  name_next++;
+  return name->ds_string;
+}
+
+/* If the file described by ST has the same contents as a file that
+   came before it in the list, make ST describe a hard link to that
+   file.  */
+void
+dedup_stat (struct stat *st)
+{
+  struct dedup_link key, *l;
+
+  if (!link_table || !S_ISREG (st->st_mode))
+    return;
+  key.dev = st->st_dev;
+  key.ino = st->st_ino;
+  l = hash_lookup (link_table, &key);
+  if (l)
+    {
+      st->st_dev = l->first_dev;
+      st->st_ino = l->first_ino;
+      st->st_nlink = l->nlink;
+    }
+}
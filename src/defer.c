@@ -23,20 +23,42 @@
 #include "extern.h"
 #include "defer.h"
 
+/* Deferments that have been freed, to be used again with their name
+   buffers by create_deferment.  */
+static struct deferment *free_deferments;
+
 struct deferment *
 create_deferment (struct cpio_file_stat *file_hdr)
 {
   struct deferment *d;
-  d = (struct deferment *) xmalloc (sizeof (struct deferment) );
+  char *name = NULL;
+  size_t name_buflen = 0;
+  size_t len = strlen (file_hdr->c_name) + 1;
+
+  d = free_deferments;
+  if (d)
+    {
+      free_deferments = d->next;
+      name = d->header.c_name;
+      name_buflen = d->header.c_name_buflen;
+    }
+  else
+    d = xmalloc (sizeof (struct deferment));
+  if (name_buflen < len)
+    {
+      name = xrealloc (name, len);
+      name_buflen = len;
+    }
   d->header = *file_hdr;
-  d->header.c_name = (char *) xmalloc (strlen (file_hdr->c_name) + 1);
-  strcpy (d->header.c_name, file_hdr->c_name);
+  d->header.c_name = memcpy (name, file_hdr->c_name, len);
+  d->header.c_name_buflen = name_buflen;
+  d->snapshot = NULL;
   return d;
 }
 
 void
 free_deferment (struct deferment *d)
 {
-  free (d->header.c_name);
-  free (d);
+  d->next = free_deferments;
+  free_deferments = d;
 }
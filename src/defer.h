@@ -19,6 +19,7 @@ struct deferment
   {
     struct deferment *next;
     struct cpio_file_stat header;
+    struct snapshot_record *snapshot; /* Record for the new snapshot.  */
   };
 
 struct deferment *create_deferment (struct cpio_file_stat *file_hdr);
@@ -22,7 +22,7 @@
    dynamic_string routines know how to get more space if it is needed
    by allocating new space and copying the current string.  */
 
-typedef struct
+typedef struct dynamic_string
 {
   size_t ds_size;   /* Actual amount of storage allocated.  */
   size_t ds_idx;    /* Index of the next free byte in the string. */
@@ -27,6 +27,32 @@ enum archive_format
 };
 
 extern enum archive_format archive_format;
+
+enum compression
+{
+  compress_none, compress_gzip, compress_xz, compress_zstd, compress_lz4
+};
+
+extern enum compression compress_option;
+
+enum sort_order
+{
+  sort_none, sort_inode, sort_extent
+};
+
+extern enum sort_order sort_option;
+extern bool reorder_flag;
+extern bool seekable_flag;
+extern off_t seekable_frame_size;
+extern bool dedup_flag;
+extern bool data_first_links_flag;
+extern size_t data_align_option;
+extern bool sparse_map_flag;
+extern bool nanoseconds_flag;
+extern bool extended_headers_flag;
+extern char *listed_incremental_option;
+extern bool incremental_flag;
+extern size_t link_memory_limit;
 extern int reset_time_flag;
 extern size_t io_block_size;
 extern int create_dir_flag;
@@ -50,6 +76,8 @@ extern int set_group_flag;
 extern gid_t set_group;
 extern int no_chown_flag;
 extern int sparse_flag;
+extern bool preallocate_flag;
+extern bool direct_io_flag;
 extern int quiet_flag;
 extern int only_verify_crc_flag;
 extern int no_abs_paths_flag;
@@ -66,6 +94,11 @@ extern int ignore_dirnlink_option;
 #define CPIO_WARN_ALL      (unsigned int)-1
 
 extern bool to_stdout_option;
+extern size_t jobs_option;
+extern size_t prefetch_option;
+extern char **walk_dirs;
+extern size_t walk_dir_count;
+extern bool cached_stat_flag;
 
 extern off_t last_header_start;
 extern int copy_matching_files;
@@ -96,6 +129,7 @@ extern char input_is_special;
 extern char output_is_special;
 extern char input_is_seekable;
 extern char output_is_seekable;
+extern struct xheader member_xheader;
 extern int (*xstat) (const char *, struct stat *);
 extern void (*copy_function) (void);
 extern char *change_directory_option;
@@ -105,6 +139,26 @@ enum { UINTMAX_STRSIZE_BOUND = INT_BUFSIZE_BOUND (intmax_t) };
 
 
 
+struct dynamic_string;
+
+/* arena.c */
+void *member_xmalloc (size_t size);
+char *member_xstrdup (char const *str);
+void member_free (void *ptr);
+void member_arena_reset (void);
+void *record_xmalloc (size_t size);
+char *record_xcharalloc (size_t n);
+
+/* compress.c */
+enum compression find_compression_method (char const *name);
+bool compression_supported (enum compression type);
+ssize_t compress_write (int out_des, char const *buf, size_t size);
+void compress_new_member (void);
+void compress_finish (int out_des);
+bool archive_decompressing (void);
+ssize_t decompress_read (int in_des, char *buf, size_t size);
+off_t decompress_skip (int in_des, off_t num_bytes);
+
 /* copyin.c */
 void warn_junk_bytes (long bytes_skipped);
 /* FIXME: make read_* static in copyin.c */
@@ -128,9 +182,34 @@ void field_width_error (const char *filename, const char *fieldname,
 /* copypass.c */
 void process_copy_pass (void);
 int link_to_maj_min_ino (char *file_name, int st_dev_maj,
-			 int st_dev_min, ino_t st_ino);
+			 int st_dev_min, ino_t st_ino, size_t nlink);
 int link_to_name (char const *link_name, char const *link_target);
 
+/* dedup.c */
+char *dedup_next_name (struct dynamic_string *name);
+void dedup_stat (struct stat *st);
+
+/* incremental.c */
+void incremental_init (void);
+bool incremental_file_changed (char const *name, struct stat const *st);
+void incremental_file_stored (void);
+struct snapshot_record *incremental_file_defer (void);
+void incremental_deferred_file_stored (struct snapshot_record *r);
+char *incremental_deletions (size_t *size);
+void incremental_finish (void);
+
+/* walk.c */
+char *walk_next_name (struct dynamic_string *name);
+
+/* xheader.c */
+void xheader_free (struct xheader *xh);
+bool sparse_map_file (int fd, char const *name, struct stat const *st,
+		      struct xheader *xh);
+off_t sparse_data_size (struct xheader const *xh);
+char *xheader_encode (struct xheader const *xh, size_t *size);
+bool xheader_decode (struct xheader *xh, char *buf, size_t size);
+void xheader_apply (struct xheader *xh, struct cpio_file_stat *file_hdr);
+
 /* dirname.c */
 char *dirname (char *path);
 
@@ -147,6 +226,13 @@ gid_t *getgidbyname (char *group);
 void process_args (int argc, char *argv[]);
 void initialize_buffers (void);
 
+/* jobs.c */
+void copyin_jobs_init (int in_des);
+bool copyin_jobs_submit (struct cpio_file_stat *file_hdr, int in_des,
+			 int out_des, int perms);
+void copyin_jobs_sync (char const *name);
+void copyin_jobs_finish (void);
+
 /* makepath.c */
 int make_path (char const *argpath, uid_t owner, gid_t group,
 	       const char *verbose_fmt_string);
@@ -164,28 +250,54 @@ const char *parse_user_spec (const char *spec_arg, uid_t *uid, gid_t *gid,
 			     char **username_arg, char **groupname_arg);
 
 /* util.c */
+void archive_direct_io_init (int archive_des, bool inherited);
+void archive_direct_io_finish (int archive_des);
+bool archive_direct_io_off (int archive_des);
+ssize_t archive_raw_read (int in_des, char *buf, size_t size);
+ssize_t archive_raw_write (int out_des, char const *buf, size_t size);
+void drop_file_cache (int fd, off_t size, bool written);
+void drop_deferred_file_cache (void);
+char *read_input_name (struct dynamic_string *name);
+char *get_next_file_name (struct dynamic_string *name);
+int cpio_fstatat (int dirfd, char const *name, struct stat *st);
+void remember_input_stat (char const *name, struct stat const *st);
+int stat_input_file_ahead (char const *name, struct stat *st);
+int stat_input_file (char const *name, struct stat *st);
+void advise_sequential (int fd);
 void tape_empty_output_buffer (int out_des);
 void disk_empty_output_buffer (int out_des, bool flush);
 void swahw_array (char *ptr, int count);
 void tape_buffered_write (char *in_buf, int out_des, off_t num_bytes);
 void tape_buffered_read (char *in_buf, int in_des, off_t num_bytes);
 int tape_buffered_peek (char *peek_buf, int in_des, int num_bytes);
+void tape_buffered_unread (char const *buf, size_t size);
 void tape_toss_input (int in_des, off_t num_bytes);
+void tape_seek_input (int in_des, off_t num_bytes);
 void copy_files_tape_to_disk (int in_des, int out_des, off_t num_bytes);
+off_t clone_to_disk (int in_des, int out_des, off_t num_bytes);
+void copy_sparse_tape_to_disk (int in_des, int out_des,
+			       struct xheader const *xh);
 void copy_files_disk_to_tape (int in_des, int out_des, off_t num_bytes, char *filename);
+void copy_sparse_disk_to_tape (int in_des, int out_des,
+			       struct xheader const *xh, char *filename);
 void copy_files_disk_to_disk (int in_des, int out_des, off_t num_bytes, char *filename);
 void warn_if_file_changed (char *file_name, off_t old_file_size,
 			   time_t old_file_mtime);
 void create_all_directories (char const *name);
 void prepare_append (int out_file_des);
+off_t tape_output_offset (void);
 char *find_inode_file (ino_t node_num,
 		       unsigned long major_num, unsigned long minor_num);
-struct inode_val *add_inode (ino_t node_num, char *file_name,
-			     unsigned long major_num, unsigned long minor_num);
+void add_inode (ino_t node_num, char *file_name,
+		unsigned long major_num, unsigned long minor_num,
+		size_t nlink);
+void count_inode_link (ino_t node_num,
+		       unsigned long major_num, unsigned long minor_num);
 int open_archive (char *file);
 void tape_offline (int tape_des);
 void get_next_reel (int tape_des);
 void set_new_media_message (char *message);
+bool archive_is_multivolume (int archive_des);
 #ifdef HPUX_CDF
 char *add_cdf_double_slashes (char *filename);
 #endif
@@ -201,6 +313,28 @@ void write_nuls_to_file (off_t num_bytes, int out_des,
 # define UMASKED_SYMLINK(name1,name2,mode)    umasked_symlink(name1,name2,mode)
 #endif /* SYMLINK_USES_UMASK */
 
+/* Flags telling restore_perms what to restore, in addition to the
+   times (if --preserve-modification-time is given).  */
+#define PERMS_CHOWN 0x1		/* Change the owner.  */
+#define PERMS_CHMOD 0x2		/* Change the mode.  */
+
+/* Errors met by restore_perms.  */
+struct perms_errors
+  {
+    int chown_errno;
+    int chmod_errno;
+    int utime_errno;
+  };
+
+int output_perms (int fd, struct cpio_file_stat *header);
+int create_output_file (struct cpio_file_stat *header, int *perms);
+void restore_perms (int fd, int dirfd, char const *name,
+		    struct cpio_file_stat *header, int perms,
+		    struct perms_errors *err);
+void report_perms_errors (struct cpio_file_stat *header,
+			  struct perms_errors const *err);
+void set_output_perms (int fd, struct cpio_file_stat *header, int perms);
+void preallocate_output (int fd, char const *name, off_t size);
 void set_perms (int fd, struct cpio_file_stat *header);
 void set_file_times (int fd, const char *name, unsigned long atime,
 		     unsigned long mtime, int atflag);
@@ -228,10 +362,10 @@ uintmax_t from_ascii (char const *where, size_t digs, unsigned logbase);
 #define FROM_HEX(f) from_ascii (f, sizeof f, LG_16)
 
 void delay_cpio_set_stat (struct cpio_file_stat *file_stat,
-			  mode_t invert_permissions);
+			  mode_t invert_permissions, int perms);
 void delay_set_stat (char const *file_name, struct stat *st,
 		     mode_t invert_permissions);
-int repair_delayed_set_stat (struct cpio_file_stat *file_hdr);
+int repair_delayed_set_stat (struct cpio_file_stat *file_hdr, int perms);
 void apply_delayed_set_stat (void);
 
 int arf_stores_inode_p (enum archive_format arf);
@@ -95,6 +95,59 @@ int no_chown_flag = false;
 /* If true, try to write sparse ("holey") files.  */
 int sparse_flag = false;
 
+/* If true, reserve the disk space of regular files before writing
+   their data.  */
+bool preallocate_flag = false;
+
+/* Compression method of the archive written in copy-out mode.  */
+enum compression compress_option = compress_none;
+
+/* If true, write a seekable compressed archive: start a new compressed
+   frame at the first member boundary after `seekable_frame_size' bytes,
+   and end the archive with a table of the frames.  */
+bool seekable_flag = false;
+off_t seekable_frame_size = 0;
+
+/* If true, store files with identical contents as hard links to the
+   first of them.  */
+bool dedup_flag = false;
+
+/* If true, attach the data of the files with several links to the
+   first of them in newc and crc archives, instead of the last.  */
+bool data_first_links_flag = false;
+
+/* If nonzero, the data of the regular files of newc and crc archives
+   start on a multiple of this many bytes.  */
+size_t data_align_option = 0;
+
+/* If true, store only the data of the sparse files of newc and crc
+   archives, with a map of their holes in an extended header.  */
+bool sparse_map_flag = false;
+
+/* If true, store the nanoseconds of the modification times of newc and
+   crc archives in extended headers.  */
+bool nanoseconds_flag = false;
+
+/* If true, store the sizes, inode numbers and modification times of
+   newc and crc archives that do not fit in their headers in extended
+   headers.  */
+bool extended_headers_flag = false;
+
+/* Snapshot file of --listed-incremental, or NULL.  */
+char *listed_incremental_option = NULL;
+
+/* If true, remove the files listed as deleted in an incremental
+   archive.  */
+bool incremental_flag = false;
+
+/* If nonzero, keep at most this many bytes of the names of the files
+   with several links in memory, and write the others to a temporary
+   file.  */
+size_t link_memory_limit = 0;
+
+/* If true, keep the archive and the files out of the page cache.  */
+bool direct_io_flag = false;
+
 /* If true, don't report number of blocks copied.  */
 int quiet_flag = false;
 
@@ -176,12 +229,37 @@ char input_is_seekable = false;
 /* true if lseek works on the output.  */
 char output_is_seekable = false;
 
+/* Attributes of the member being read in copy-in mode that are held by
+   the extended header before it, if any.  */
+struct xheader member_xheader;
+
 /* Print extra warning messages */
 unsigned int warn_option = 0;
 
 /* Extract to standard output? */
 bool to_stdout_option = false;
 
+/* Number of threads extracting regular files in copy-in mode (--jobs).  */
+size_t jobs_option = 1;
+
+/* Number of files of the input list to read in advance (--prefetch).  */
+size_t prefetch_option = 0;
+
+/* Directories to walk instead of reading the list of files from the
+   standard input (--walk).  */
+char **walk_dirs = NULL;
+size_t walk_dir_count = 0;
+
+/* If true, accept the file attributes cached by network file systems
+   (--cached-stat).  */
+bool cached_stat_flag = false;
+
+/* Order in which to read the files of the list (--sort).  */
+enum sort_order sort_option = sort_none;
+
+/* If true, store the files in the order they are read (--reorder).  */
+bool reorder_flag = false;
+
 /* A pointer to either lstat or stat, depending on whether
    dereferencing of symlinks is done for input files.  */
 int (*xstat) (const char *, struct stat *);
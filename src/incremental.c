@@ -0,0 +1,377 @@
+/* incremental.c - incremental archives
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* With --listed-incremental=SNAPSHOT, copy-out mode stores only the
+   files that are new or have changed since the archive that wrote
+   SNAPSHOT.  For each name of the list, the snapshot records the device
+   and inode numbers, the size and the modification and status change
+   times of the file.  A file is recorded once it is stored in the
+   archive, or found unchanged; one that cannot be stored is left out,
+   so that the next archive tries it again.  The names of the old
+   snapshot that are no longer in the list are stored before the
+   trailer, in a member named CPIO_DELETIONS_NAME, which copy-in mode
+   applies with --incremental.  The new snapshot replaces the old one
+   once the archive is complete.
+
+   A snapshot file starts with SNAPSHOT_MAGIC, followed by one record
+   per name: seven little-endian numbers (device, inode, size, then the
+   seconds and nanoseconds of the modification and status change times)
+   and the name, terminated by a NUL.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "cpiohdr.h"
+#include "dstring.h"
+#include "extern.h"
+#include <hash.h>
+#include <stat-time.h>
+#include <timespec.h>
+#include <xgetcwd.h>
+
+#define SNAPSHOT_MAGIC "GNU cpio snapshot 1\n"
+#define SNAPSHOT_RECORD_SIZE 48
+
+struct snapshot_entry
+{
+  char *name;
+  uintmax_t dev;
+  uintmax_t ino;
+  uintmax_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+  bool seen;			/* True if the name is still in the list.  */
+};
+
+/* A record waiting for its file to be stored in the archive.  */
+struct snapshot_record
+{
+  unsigned char buf[SNAPSHOT_RECORD_SIZE];
+  char *name;
+};
+
+static Hash_table *snapshot_table;
+static char *snapshot_file;	/* Absolute name of the snapshot.  */
+static char *new_snapshot_file;	/* Snapshot being written.  */
+static FILE *new_snapshot;
+static struct snapshot_record *pending_record; /* Record of the file
+						  being stored.  */
+
+static size_t
+snapshot_hasher (void const *data, size_t n_buckets)
+{
+  struct snapshot_entry const *e = data;
+  return hash_string (e->name, n_buckets);
+}
+
+static bool
+snapshot_compare (void const *a, void const *b)
+{
+  struct snapshot_entry const *ea = a;
+  struct snapshot_entry const *eb = b;
+  return strcmp (ea->name, eb->name) == 0;
+}
+
+static void
+put_number (unsigned char *p, uintmax_t v, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+static uintmax_t
+get_number (unsigned char const *p, int size)
+{
+  uintmax_t v = 0;
+
+  while (size-- > 0)
+    v = (v << 8) | p[size];
+  return v;
+}
+
+/* Encode the record of the file described by ST into BUF.  */
+static void
+encode_record (unsigned char *buf, struct stat const *st)
+{
+  struct timespec mtime = get_stat_mtime (st);
+  struct timespec ctime = get_stat_ctime (st);
+
+  put_number (buf, st->st_dev, 8);
+  put_number (buf + 8, st->st_ino, 8);
+  put_number (buf + 16, st->st_size, 8);
+  put_number (buf + 24, mtime.tv_sec, 8);
+  put_number (buf + 32, mtime.tv_nsec, 4);
+  put_number (buf + 36, ctime.tv_sec, 8);
+  put_number (buf + 44, ctime.tv_nsec, 4);
+}
+
+static void
+decode_record (struct snapshot_entry *e, unsigned char const *buf)
+{
+  e->dev = get_number (buf, 8);
+  e->ino = get_number (buf + 8, 8);
+  e->size = get_number (buf + 16, 8);
+  e->mtime.tv_sec = get_number (buf + 24, 8);
+  e->mtime.tv_nsec = get_number (buf + 32, 4);
+  e->ctime.tv_sec = get_number (buf + 36, 8);
+  e->ctime.tv_nsec = get_number (buf + 44, 4);
+}
+
+static void
+invalid_snapshot (void)
+{
+  error (PAXEXIT_FAILURE, 0, _("%s: invalid snapshot file"),
+	 quote (snapshot_file));
+}
+
+/* Read the snapshot left by the previous archive, if any.  */
+static void
+read_snapshot (void)
+{
+  FILE *fp;
+  char magic[sizeof SNAPSHOT_MAGIC - 1];
+  unsigned char buf[SNAPSHOT_RECORD_SIZE];
+  dynamic_string name = DYNAMIC_STRING_INITIALIZER;
+  size_t n;
+
+  snapshot_table = hash_initialize (0, NULL, snapshot_hasher,
+				    snapshot_compare, NULL);
+  if (!snapshot_table)
+    xalloc_die ();
+
+  fp = fopen (snapshot_file, "rb");
+  if (!fp)
+    {
+      if (errno == ENOENT)
+	return;
+      open_fatal (snapshot_file);
+    }
+
+  if (fread (magic, sizeof magic, 1, fp) != 1
+      || memcmp (magic, SNAPSHOT_MAGIC, sizeof magic) != 0)
+    invalid_snapshot ();
+
+  while ((n = fread (buf, 1, sizeof buf, fp)) == sizeof buf)
+    {
+      struct snapshot_entry *e, *old;
+
+      if (!ds_fgetstr (fp, &name, '\0'))
+	invalid_snapshot ();
+      e = xmalloc (sizeof *e);
+      decode_record (e, buf);
+      e->name = xstrdup (name.ds_string);
+      e->seen = false;
+      old = hash_insert (snapshot_table, e);
+      if (!old)
+	xalloc_die ();
+      if (old != e)
+	{
+	  /* The name is recorded more than once.  */
+	  free (e->name);
+	  free (e);
+	}
+    }
+  if (n != 0 || ferror (fp))
+    invalid_snapshot ();
+  fclose (fp);
+  ds_free (&name);
+}
+
+/* Read the snapshot named by `listed_incremental_option', and start
+   writing the new one.  This must be called before changing to the
+   directory given by --directory.  */
+void
+incremental_init (void)
+{
+  if (ISSLASH (listed_incremental_option[0]))
+    snapshot_file = xstrdup (listed_incremental_option);
+  else
+    {
+      char *pwd = xgetcwd ();
+
+      snapshot_file = xmalloc (strlen (pwd)
+			       + strlen (listed_incremental_option) + 2);
+      sprintf (snapshot_file, "%s/%s", pwd, listed_incremental_option);
+      free (pwd);
+    }
+
+  read_snapshot ();
+
+  new_snapshot_file = xmalloc (strlen (snapshot_file) + 5);
+  sprintf (new_snapshot_file, "%s.new", snapshot_file);
+  new_snapshot = fopen (new_snapshot_file, "wb");
+  if (!new_snapshot)
+    open_fatal (new_snapshot_file);
+  fputs (SNAPSHOT_MAGIC, new_snapshot);
+}
+
+static void
+write_record (unsigned char const *buf, char const *name)
+{
+  fwrite (buf, SNAPSHOT_RECORD_SIZE, 1, new_snapshot);
+  fwrite (name, strlen (name) + 1, 1, new_snapshot);
+}
+
+static void
+free_record (struct snapshot_record *r)
+{
+  free (r->name);
+  free (r);
+}
+
+/* Return true if the file NAME, described by ST, has to be stored in
+   the archive, i.e. if it is not in the old snapshot or has changed
+   since.  An unchanged file is recorded in the new snapshot at once;
+   the record of one to store waits for incremental_file_stored.  */
+bool
+incremental_file_changed (char const *name, struct stat const *st)
+{
+  unsigned char buf[SNAPSHOT_RECORD_SIZE];
+  struct snapshot_entry key, *e, cur;
+
+  if (!listed_incremental_option)
+    return true;
+
+  /* The previous file could not be stored.  */
+  if (pending_record)
+    {
+      free_record (pending_record);
+      pending_record = NULL;
+    }
+
+  encode_record (buf, st);
+  key.name = (char *) name;
+  e = hash_lookup (snapshot_table, &key);
+  if (e)
+    {
+      e->seen = true;
+      decode_record (&cur, buf);
+      if (cur.dev == e->dev && cur.ino == e->ino && cur.size == e->size
+	  && timespec_cmp (cur.mtime, e->mtime) == 0
+	  && timespec_cmp (cur.ctime, e->ctime) == 0)
+	{
+	  write_record (buf, name);
+	  return false;
+	}
+    }
+
+  pending_record = xmalloc (sizeof *pending_record);
+  memcpy (pending_record->buf, buf, sizeof buf);
+  pending_record->name = xstrdup (name);
+  return true;
+}
+
+/* Record the file last passed to incremental_file_changed in the new
+   snapshot, now that it is stored in the archive.  */
+void
+incremental_file_stored (void)
+{
+  if (pending_record)
+    {
+      incremental_deferred_file_stored (pending_record);
+      pending_record = NULL;
+    }
+}
+
+/* Return the record of the file last passed to
+   incremental_file_changed, whose header is written later, or NULL.
+   Pass it to incremental_deferred_file_stored once it is.  */
+struct snapshot_record *
+incremental_file_defer (void)
+{
+  struct snapshot_record *r = pending_record;
+  pending_record = NULL;
+  return r;
+}
+
+/* Record the file of R, as returned by incremental_file_defer, in the
+   new snapshot, and free R.  */
+void
+incremental_deferred_file_stored (struct snapshot_record *r)
+{
+  if (r)
+    {
+      write_record (r->buf, r->name);
+      free_record (r);
+    }
+}
+
+static int
+reverse_name_compare (void const *a, void const *b)
+{
+  return strcmp (*(char *const *) b, *(char *const *) a);
+}
+
+/* Return the list of the names of the old snapshot that were not seen
+   in this run, as they would be stored in the archive, each followed
+   by a NUL.  Store its size in *SIZE.  The names come in reverse order,
+   so that the files in a directory come before it.  Return NULL if no
+   file was deleted.  */
+char *
+incremental_deletions (size_t *size)
+{
+  struct snapshot_entry *e;
+  char **names = NULL;
+  size_t count = 0, alloc = 0, i;
+  char *buf, *p;
+
+  *size = 0;
+  for (e = hash_get_first (snapshot_table); e;
+       e = hash_get_next (snapshot_table, e))
+    if (!e->seen)
+      {
+	if (count == alloc)
+	  names = x2nrealloc (names, &alloc, sizeof names[0]);
+	names[count++] = e->name;
+      }
+  if (count == 0)
+    return NULL;
+
+  /* The names are modified only now, as they are the keys of the
+     table.  */
+  for (i = 0; i < count; i++)
+    {
+      cpio_safer_name_suffix (names[i], false, !no_abs_paths_flag, true);
+      *size += strlen (names[i]) + 1;
+    }
+
+  qsort (names, count, sizeof names[0], reverse_name_compare);
+  p = buf = xmalloc (*size);
+  for (i = 0; i < count; i++)
+    p = stpcpy (p, names[i]) + 1;
+  free (names);
+  return buf;
+}
+
+/* Replace the old snapshot with the new one, once the archive is
+   complete.  */
+void
+incremental_finish (void)
+{
+  /* The last file could not be stored.  */
+  if (pending_record)
+    free_record (pending_record);
+  if (ferror (new_snapshot) | fclose (new_snapshot))
+    error (PAXEXIT_FAILURE, errno, _("%s: cannot write snapshot file"),
+	   quote (new_snapshot_file));
+  if (rename (new_snapshot_file, snapshot_file))
+    error (PAXEXIT_FAILURE, errno, _("cannot rename %s to %s"),
+	   quote_n (0, new_snapshot_file), quote_n (1, snapshot_file));
+}
@@ -0,0 +1,568 @@
+/* jobs.c - extract regular files in parallel
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* The main thread keeps doing everything process_copy_in did before:
+   it reads the headers, creates directories, links and device nodes,
+   and opens the output file of each regular member, so that the names
+   appear in the file system in archive order.  Instead of copying the
+   data itself, it hands the open descriptor to a pool of worker
+   threads, which write the data, restore the owner, mode and times,
+   and close the file.
+
+   The data reach the workers in one of two ways.  When the archive is
+   a local regular file, the main thread records the archive offset of
+   the data and seeks past it, and the worker reads them with pread.
+   Otherwise (a pipe or a tape), the main thread reads the data into a
+   chunk of memory shared by several small members.  Chunks are
+   reference counted and released when all their jobs have completed.
+   Members too large for a chunk are copied by the main thread.
+
+   Errors found by the workers are recorded in the job and reported
+   by the main thread when it reaps the job, since the error reporting
+   functions are not thread-safe.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "cpiohdr.h"
+#include "extern.h"
+#include <paxlib.h>
+#include <rmt.h>
+#include <hash.h>
+
+/* Size of the per-worker data buffer.  Must be a multiple of
+   DISK_IO_BLOCK_SIZE, so that swapping and sparse detection see the
+   same units as disk_empty_output_buffer.  */
+#define JOB_BUFFER_SIZE (64 * 1024)
+
+/* Maximum number of queued or running jobs per worker.  Each job holds
+   an open output descriptor.  */
+#define JOBS_PER_WORKER 4
+
+/* Size of a chunk of member data read from a non-seekable archive.
+   Larger members are copied by the main thread.  */
+#define JOB_CHUNK_SIZE (1024 * 1024)
+
+/* Maximum number of chunks alive at a time.  */
+#define JOB_MAX_CHUNKS 64
+
+enum job_status
+  {
+    job_ok,
+    job_read_error,
+    job_premature_eof,
+    job_write_error,
+    job_partial_write
+  };
+
+struct job_chunk
+  {
+    size_t refcount;              /* Number of jobs using the chunk, plus
+				     one while it is being filled.  */
+    size_t used;                  /* Bytes used so far.  */
+    char data[JOB_CHUNK_SIZE];
+  };
+
+struct copyin_job
+  {
+    struct copyin_job *next;
+    struct cpio_file_stat header; /* Copy of the member header.  */
+    int out_des;                  /* Output file, opened by the caller.  */
+    int perms;                    /* What restore_perms has to restore.  */
+    off_t offset;                 /* Offset of the data in the archive.  */
+    struct job_chunk *chunk;      /* Chunk holding the data, or NULL if
+				     they are to be read at OFFSET.  */
+    char *data;                   /* Start of the data in CHUNK.  */
+    bool swapping_halfwords;      /* Copies of the per-file swap flags.  */
+    bool swapping_bytes;
+    uint32_t crc;                 /* Checksum computed by the worker.  */
+    enum job_status status;
+    int errnum;
+    struct perms_errors perms_err; /* Errors from restoring metadata.  */
+    int close_errno;
+  };
+
+static bool jobs_active;
+static bool jobs_seekable;
+static int jobs_in_des;
+static struct job_chunk *current_chunk;
+static size_t live_chunks;
+static pthread_t *workers;
+static size_t max_in_flight;
+static size_t jobs_in_flight;
+
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+static struct copyin_job *pending_head, *pending_tail;
+static struct copyin_job *done_head;
+static bool jobs_shutdown;
+
+/* Names of files being written by the workers.  Used by the main
+   thread only.  */
+static Hash_table *job_names;
+
+static size_t
+job_name_hasher (void const *name, size_t n_buckets)
+{
+  return hash_string (name, n_buckets);
+}
+
+static bool
+job_name_compare (void const *a, void const *b)
+{
+  return strcmp (a, b) == 0;
+}
+
+static int
+job_fill_buffer (struct copyin_job *job, char *buf, size_t size, off_t pos)
+{
+  size_t done = 0;
+
+  while (done < size)
+    {
+      ssize_t n = pread (jobs_in_des, buf + done, size - done,
+			 job->offset + pos + done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  job->status = job_read_error;
+	  job->errnum = errno;
+	  return -1;
+	}
+      if (n == 0)
+	{
+	  job->status = job_premature_eof;
+	  return -1;
+	}
+      done += n;
+    }
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
+  if (direct_io_flag)
+    posix_fadvise (jobs_in_des, job->offset + pos, size, POSIX_FADV_DONTNEED);
+#endif
+  return 0;
+}
+
+static int
+job_write (struct copyin_job *job, char *buf, size_t size, off_t pos)
+{
+  while (size > 0)
+    {
+      ssize_t n = pwrite (job->out_des, buf, size, pos);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  job->status = job_write_error;
+	  job->errnum = errno;
+	  return -1;
+	}
+      if (n == 0)
+	{
+	  job->status = job_partial_write;
+	  return -1;
+	}
+      buf += n;
+      pos += n;
+      size -= n;
+    }
+  return 0;
+}
+
+static bool
+block_is_zero (char const *buf, size_t size)
+{
+  return buf[0] == 0 && memcmp (buf, buf + 1, size - 1) == 0;
+}
+
+/* Process N bytes of the data of JOB, found in BUF, and write them at
+   offset POS of the output file.  Set *TRAILING_HOLE if the last block
+   was skipped as a hole.  This is the threaded counterpart of
+   copy_files_tape_to_disk followed by disk_empty_output_buffer.  */
+static int
+copyin_job_write (struct copyin_job *job, char *buf, size_t n, off_t pos,
+		  bool *trailing_hole)
+{
+  size_t k;
+
+  if (crc_i_flag)
+    for (k = 0; k < n; k++)
+      job->crc += buf[k] & 0xff;
+
+  if (job->swapping_halfwords)
+    {
+      swahw_array (buf, n / 4);
+      if (job->swapping_bytes)
+	swab_array (buf, n / 2);
+    }
+  else if (job->swapping_bytes)
+    swab_array (buf, n / 2);
+
+  if (!sparse_flag)
+    return job_write (job, buf, n, pos);
+
+  /* Skip whole zero blocks, as sparse_write does.  */
+  for (k = 0; k < n; k += DISK_IO_BLOCK_SIZE)
+    {
+      size_t len = (n - k < DISK_IO_BLOCK_SIZE) ? n - k : DISK_IO_BLOCK_SIZE;
+      if (len == DISK_IO_BLOCK_SIZE && block_is_zero (buf + k, len))
+	*trailing_hole = true;
+      else
+	{
+	  if (job_write (job, buf + k, len, pos + k))
+	    return -1;
+	  *trailing_hole = false;
+	}
+    }
+  return 0;
+}
+
+/* Copy the data of JOB to its output file, restore its metadata and
+   close it.  BUF is a scratch buffer of JOB_BUFFER_SIZE bytes.  */
+static void
+copyin_job_run (struct copyin_job *job, char *buf)
+{
+  off_t size = job->header.c_filesize;
+  off_t pos = 0;
+  bool trailing_hole = false;
+
+  if (job->chunk)
+    {
+      if (copyin_job_write (job, job->data, size, 0, &trailing_hole))
+	return;
+    }
+  else
+    while (pos < size)
+      {
+	size_t n = (size - pos < JOB_BUFFER_SIZE) ? size - pos : JOB_BUFFER_SIZE;
+
+	if (job_fill_buffer (job, buf, n, pos)
+	    || copyin_job_write (job, buf, n, pos, &trailing_hole))
+	  return;
+	pos += n;
+      }
+
+  if (trailing_hole && ftruncate (job->out_des, size))
+    {
+      job->status = job_write_error;
+      job->errnum = errno;
+      return;
+    }
+
+  drop_file_cache (job->out_des, size, true);
+  restore_perms (job->out_des, AT_FDCWD, job->header.c_name, &job->header,
+		 job->perms, &job->perms_err);
+  if (close (job->out_des) < 0)
+    job->close_errno = errno;
+}
+
+static void *
+copyin_worker (void *arg)
+{
+  char *buf = xmalloc (JOB_BUFFER_SIZE);
+
+  pthread_mutex_lock (&jobs_mutex);
+  for (;;)
+    {
+      struct copyin_job *job;
+
+      while (!pending_head && !jobs_shutdown)
+	pthread_cond_wait (&jobs_ready, &jobs_mutex);
+      if (!pending_head)
+	break;
+      job = pending_head;
+      pending_head = job->next;
+      if (!pending_head)
+	pending_tail = NULL;
+      pthread_mutex_unlock (&jobs_mutex);
+
+      copyin_job_run (job, buf);
+
+      pthread_mutex_lock (&jobs_mutex);
+      job->next = done_head;
+      done_head = job;
+      pthread_cond_signal (&jobs_done);
+    }
+  pthread_mutex_unlock (&jobs_mutex);
+  free (buf);
+  return NULL;
+}
+
+static void
+chunk_release (struct job_chunk *chunk)
+{
+  if (--chunk->refcount == 0)
+    {
+      free (chunk);
+      live_chunks--;
+    }
+}
+
+/* Finish JOB in the main thread: report the errors met by the worker
+   and release the job.  */
+static void
+copyin_job_complete (struct copyin_job *job)
+{
+  struct cpio_file_stat *hdr = &job->header;
+
+  hash_remove (job_names, hdr->c_name);
+  switch (job->status)
+    {
+    case job_ok:
+      break;
+
+    case job_read_error:
+      error (PAXEXIT_FAILURE, job->errnum, _("read error"));
+
+    case job_premature_eof:
+      error (PAXEXIT_FAILURE, 0, _("premature end of file"));
+
+    case job_write_error:
+      error (PAXEXIT_FAILURE, job->errnum, _("write error"));
+
+    case job_partial_write:
+      error (PAXEXIT_FAILURE, 0, _("write error: partial write"));
+    }
+
+  report_perms_errors (hdr, &job->perms_err);
+  if (job->close_errno)
+    {
+      errno = job->close_errno;
+      close_error (hdr->c_name);
+    }
+
+  if (archive_format == arf_crcascii && job->crc != hdr->c_chksum)
+    error (0, 0, _("%s: checksum error (0x%x, should be 0x%x)"),
+	   quote (hdr->c_name), job->crc, hdr->c_chksum);
+
+  if (job->chunk)
+    chunk_release (job->chunk);
+  free (hdr->c_name);
+  free (job);
+}
+
+/* Complete the finished jobs.  If WAIT is true, wait until at least
+   one job finishes.  */
+static void
+copyin_jobs_reap (bool wait)
+{
+  struct copyin_job *list;
+
+  pthread_mutex_lock (&jobs_mutex);
+  if (wait)
+    while (!done_head)
+      pthread_cond_wait (&jobs_done, &jobs_mutex);
+  list = done_head;
+  done_head = NULL;
+  pthread_mutex_unlock (&jobs_mutex);
+
+  while (list)
+    {
+      struct copyin_job *next = list->next;
+      copyin_job_complete (list);
+      jobs_in_flight--;
+      list = next;
+    }
+}
+
+static void
+copyin_jobs_drain (void)
+{
+  while (jobs_in_flight)
+    copyin_jobs_reap (true);
+}
+
+/* Start the worker threads, if --jobs was given.  IN_DES is the
+   archive.  */
+void
+copyin_jobs_init (int in_des)
+{
+  size_t i;
+  int rc;
+
+  if (jobs_option <= 1 || to_stdout_option || table_flag || append_flag
+      || only_verify_crc_flag)
+    return;
+
+  jobs_in_des = in_des;
+  jobs_seekable = input_is_seekable && !_isrmt (in_des);
+  /* The workers read the member data at arbitrary offsets.  */
+  if (jobs_seekable)
+    archive_direct_io_off (in_des);
+  job_names = hash_initialize (0, NULL, job_name_hasher, job_name_compare,
+			       NULL);
+  if (!job_names)
+    xalloc_die ();
+
+  workers = xcalloc (jobs_option, sizeof workers[0]);
+  for (i = 0; i < jobs_option; i++)
+    {
+      rc = pthread_create (&workers[i], NULL, copyin_worker, NULL);
+      if (rc)
+	{
+	  if (i == 0)
+	    {
+	      error (0, rc, _("cannot start extraction threads"));
+	      free (workers);
+	      workers = NULL;
+	      return;
+	    }
+	  break;
+	}
+    }
+  jobs_option = i;
+  max_in_flight = i * JOBS_PER_WORKER;
+  jobs_active = true;
+}
+
+/* Return a chunk with at least SIZE bytes of free space.  */
+static struct job_chunk *
+chunk_get (size_t size)
+{
+  if (current_chunk && JOB_CHUNK_SIZE - current_chunk->used < size)
+    {
+      chunk_release (current_chunk);
+      current_chunk = NULL;
+    }
+  if (!current_chunk)
+    {
+      while (live_chunks >= JOB_MAX_CHUNKS)
+	copyin_jobs_reap (true);
+      current_chunk = xmalloc (sizeof *current_chunk);
+      current_chunk->refcount = 1;
+      current_chunk->used = 0;
+      live_chunks++;
+    }
+  return current_chunk;
+}
+
+/* Hand the data of the regular file FILE_HDR over to a worker thread.
+   OUT_DES is the output file, opened by the caller, and PERMS is as
+   returned by output_perms for it.  On success, consume the file data
+   from IN_DES and return true.  The worker then writes the data,
+   restores the metadata and closes OUT_DES.  Return false if the file
+   must be copied by the caller.  */
+bool
+copyin_jobs_submit (struct cpio_file_stat *file_hdr, int in_des, int out_des,
+		    int perms)
+{
+  struct copyin_job *job;
+  off_t offset = 0;
+
+  if (!jobs_active || file_hdr->c_filesize == 0)
+    return false;
+
+  /* Offsets in a compressed archive are not those of the member data,
+     which the main thread has to read.  */
+  if (jobs_seekable && archive_decompressing ())
+    jobs_seekable = false;
+
+  if (jobs_seekable)
+    {
+      offset = lseek (in_des, 0, SEEK_CUR);
+      if (offset < 0)
+	return false;
+      offset -= input_size;
+    }
+  else if (file_hdr->c_filesize > JOB_CHUNK_SIZE)
+    return false;
+
+  while (jobs_in_flight >= max_in_flight)
+    copyin_jobs_reap (true);
+
+  job = xzalloc (sizeof *job);
+  job->header = *file_hdr;
+  job->header.c_name = xstrdup (file_hdr->c_name);
+  job->header.c_name_buflen = strlen (file_hdr->c_name) + 1;
+  job->header.c_tar_linkname = NULL;
+  job->out_des = out_des;
+  job->perms = perms;
+  job->offset = offset;
+  job->swapping_halfwords = swapping_halfwords;
+  job->swapping_bytes = swapping_bytes;
+  job->status = job_ok;
+
+  if (!hash_insert (job_names, job->header.c_name))
+    xalloc_die ();
+
+  if (jobs_seekable)
+    tape_seek_input (in_des, file_hdr->c_filesize);
+  else
+    {
+      job->chunk = chunk_get (file_hdr->c_filesize);
+      job->chunk->refcount++;
+      job->data = job->chunk->data + job->chunk->used;
+      job->chunk->used += file_hdr->c_filesize;
+      tape_buffered_read (job->data, in_des, file_hdr->c_filesize);
+    }
+
+  pthread_mutex_lock (&jobs_mutex);
+  if (pending_tail)
+    pending_tail->next = job;
+  else
+    pending_head = job;
+  pending_tail = job;
+  pthread_cond_signal (&jobs_ready);
+  pthread_mutex_unlock (&jobs_mutex);
+  jobs_in_flight++;
+
+  copyin_jobs_reap (false);
+  return true;
+}
+
+/* Wait for all jobs to finish if the file NAME is still being
+   written.  Called before looking at an existing file of that name.  */
+void
+copyin_jobs_sync (char const *name)
+{
+  if (jobs_active && jobs_in_flight && hash_lookup (job_names, name))
+    copyin_jobs_drain ();
+}
+
+/* Wait for all jobs to finish and stop the worker threads.  */
+void
+copyin_jobs_finish (void)
+{
+  size_t i;
+
+  if (!jobs_active)
+    return;
+
+  copyin_jobs_drain ();
+  if (current_chunk)
+    {
+      chunk_release (current_chunk);
+      current_chunk = NULL;
+    }
+
+  pthread_mutex_lock (&jobs_mutex);
+  jobs_shutdown = true;
+  pthread_cond_broadcast (&jobs_ready);
+  pthread_mutex_unlock (&jobs_mutex);
+  for (i = 0; i < jobs_option; i++)
+    pthread_join (workers[i], NULL);
+
+  free (workers);
+  workers = NULL;
+  hash_free (job_names);
+  job_names = NULL;
+  jobs_active = false;
+}
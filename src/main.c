@@ -43,6 +43,7 @@
 #include <rmt.h>
 #include <rmt-command.h>
 #include "configmake.h"
+#include <pagealign_alloc.h>
 
 enum cpio_options {
   NO_ABSOLUTE_FILENAMES_OPTION=256,
@@ -62,7 +63,26 @@ enum cpio_options {
   IGNORE_DIRNLINK_OPTION,
   DEVICE_INDEPENDENT_OPTION,
   QUOTING_STYLE_OPTION,
-  QUOTE_CHARS_OPTION
+  QUOTE_CHARS_OPTION,
+  JOBS_OPTION,
+  PREALLOCATE_OPTION,
+  DIRECT_IO_OPTION,
+  PREFETCH_OPTION,
+  COMPRESS_OPTION,
+  SEEKABLE_OPTION,
+  DEDUP_OPTION,
+  LISTED_INCREMENTAL_OPTION,
+  INCREMENTAL_OPTION,
+  WALK_OPTION,
+  CACHED_STAT_OPTION,
+  SORT_OPTION,
+  REORDER_OPTION,
+  LINK_MEMORY_OPTION,
+  DATA_FIRST_LINKS_OPTION,
+  DATA_ALIGN_OPTION,
+  SPARSE_MAP_OPTION,
+  NANOSECONDS_OPTION,
+  EXTENDED_HEADERS_OPTION
 };
 
 const char *program_authors[] =
@@ -128,8 +148,12 @@ static struct argp_option options[] = {
    N_("Print a \".\" for each file processed"), GRID+1 },
   {"io-size", 'C', N_("NUMBER"), 0,
    N_("Set the I/O block size to the given NUMBER of bytes"), GRID+1 },
+  {"direct-io", DIRECT_IO_OPTION, NULL, 0,
+   N_("Keep the archive and the copied files out of the page cache"), GRID+1 },
   {"quiet", QUIET_OPTION, NULL, 0,
    N_("Do not print the number of blocks copied"), GRID+1 },
+  {"link-memory", LINK_MEMORY_OPTION, N_("MBYTES"), 0,
+   N_("Keep at most MBYTES megabytes of hard link names in memory, and the others in a temporary file"), GRID+1 },
   {"verbose", 'v', NULL, 0,
    N_("Verbosely list the files processed"), GRID+1 },
 #ifdef DEBUG_CPIO
@@ -166,6 +190,9 @@ static struct argp_option options[] = {
    N_("Operation modifiers valid only in copy-in mode:"), GRID },
   {"nonmatching", 'f', 0, 0,
    N_("Only copy files that do not match any of the given patterns"), GRID+1 },
+  {"jobs", JOBS_OPTION, N_("NUMBER"), 0,
+   N_("Use NUMBER threads to extract regular files from a seekable archive"),
+   GRID+1 },
   {"numeric-uid-gid", 'n', 0, 0,
    N_("In the verbose table of contents listing, show numeric UID and GID"),
    GRID+1 },
@@ -184,6 +211,9 @@ static struct argp_option options[] = {
   {"swap-halfwords", 'S', NULL, 0,
    N_("Swap the halfwords of each word (4 bytes) in the files"),
    GRID+1 },
+  {"incremental", INCREMENTAL_OPTION, NULL, 0,
+   N_("Remove the files listed as deleted in an incremental archive"),
+   GRID+1 },
   {"to-stdout", TO_STDOUT_OPTION, NULL, 0,
    N_("Extract files to standard output"), GRID+1 },
   {NULL, 'I', N_("[[USER@]HOST:]FILE-NAME"), 0,
@@ -207,6 +237,24 @@ static struct argp_option options[] = {
   {"device-independent", DEVICE_INDEPENDENT_OPTION, NULL, 0,
    N_("Create device-independent (reproducible) archives") },
   {"reproducible", 0, NULL, OPTION_ALIAS },
+  {"compress", COMPRESS_OPTION, N_("METHOD"), 0,
+   N_("Compress the archive with METHOD: gzip, xz, zstd or lz4"), GRID+1 },
+  {"seekable", SEEKABLE_OPTION, N_("MBYTES"), OPTION_ARG_OPTIONAL,
+   N_("Start a new compressed frame at member boundaries, at most every MBYTES megabytes, and write a seek table"), GRID+1 },
+  {"dedup", DEDUP_OPTION, NULL, 0,
+   N_("Store files with identical contents as hard links to the first of them"), GRID+1 },
+  {"data-first-links", DATA_FIRST_LINKS_OPTION, NULL, 0,
+   N_("In newc and crc archives, store the data of a file with several links with its first link rather than the last"), GRID+1 },
+  {"data-align", DATA_ALIGN_OPTION, N_("BYTES"), 0,
+   N_("In newc and crc archives, start the data of each regular file on a multiple of BYTES, a power of 2 up to 4096"), GRID+1 },
+  {"sparse-map", SPARSE_MAP_OPTION, NULL, 0,
+   N_("In newc and crc archives, store only the data of sparse files, with a map of their holes"), GRID+1 },
+  {"nanoseconds", NANOSECONDS_OPTION, NULL, 0,
+   N_("In newc and crc archives, store the nanoseconds of modification times"), GRID+1 },
+  {"extended-headers", EXTENDED_HEADERS_OPTION, NULL, 0,
+   N_("In newc and crc archives, store the sizes, inode numbers and modification times that do not fit in the header"), GRID+1 },
+  {"listed-incremental", LISTED_INCREMENTAL_OPTION, N_("SNAPSHOT"), 0,
+   N_("Store only the files changed since the archive that wrote SNAPSHOT, and update it"), GRID+1 },
 #undef GRID
 
   /* ********** */
@@ -238,6 +286,16 @@ static struct argp_option options[] = {
    N_("Dereference  symbolic  links  (copy  the files that they point to instead of copying the links)."), GRID+1 },
   {"reset-access-time", 'a', NULL, 0,
    N_("Reset the access times of files after reading them"), GRID+1 },
+  {"prefetch", PREFETCH_OPTION, N_("NUMBER"), 0,
+   N_("Read NUMBER files of the list in advance"), GRID+1 },
+  {"walk", WALK_OPTION, N_("DIR"), 0,
+   N_("Copy DIR and the files below it instead of reading the list of files"), GRID+1 },
+  {"cached-stat", CACHED_STAT_OPTION, NULL, 0,
+   N_("Accept the file attributes cached by network file systems"), GRID+1 },
+  {"sort", SORT_OPTION, N_("ORDER"), 0,
+   N_("Read the files of the list in ORDER: inode or extent"), GRID+1 },
+  {"reorder", REORDER_OPTION, NULL, 0,
+   N_("With --sort, copy the files in the order they are read"), GRID+1 },
 
 #undef GRID
   /* ********** */
@@ -254,6 +312,8 @@ static struct argp_option options[] = {
    N_("Replace all files unconditionally"), GRID+1 },
   {"sparse", SPARSE_OPTION, NULL, 0,
    N_("Write files with large blocks of zeros as sparse files"), GRID+1 },
+  {"preallocate", PREALLOCATE_OPTION, NULL, 0,
+   N_("Reserve disk space for regular files before writing them"), GRID+1 },
 #undef GRID
 
   {0, 0, 0, 0}
@@ -261,6 +321,7 @@ static struct argp_option options[] = {
 
 static char *input_archive_name = 0;
 static char *output_archive_name = 0;
+static size_t walk_dir_alloc = 0;
 
 static int
 warn_control (char *arg)
@@ -445,6 +506,57 @@ crc newc odc bin ustar tar (all-caps also recognized)"), arg));
       input_archive_name = arg;
       break;
 
+    case JOBS_OPTION:		/* --jobs */
+      {
+	unsigned long n;
+	char *p;
+
+	errno = 0;
+	n = strtoul (arg, &p, 10);
+	if (errno || *p || n == 0 || n > 1024)
+	  USAGE_ERROR ((0, 0, _("invalid number of jobs: %s"), arg));
+	jobs_option = n;
+      }
+      break;
+
+    case PREFETCH_OPTION:	/* --prefetch */
+      {
+	unsigned long n;
+	char *p;
+
+	errno = 0;
+	n = strtoul (arg, &p, 10);
+	if (errno || *p || n > 1024)
+	  USAGE_ERROR ((0, 0, _("invalid number of files to prefetch: %s"),
+			arg));
+	prefetch_option = n;
+      }
+      break;
+
+    case SORT_OPTION:
+      if (strcmp (arg, "inode") == 0)
+	sort_option = sort_inode;
+      else if (strcmp (arg, "extent") == 0)
+	sort_option = sort_extent;
+      else
+	USAGE_ERROR ((0, 0, _("invalid sort order: %s"), arg));
+      break;
+
+    case REORDER_OPTION:
+      reorder_flag = true;
+      break;
+
+    case CACHED_STAT_OPTION:
+      cached_stat_flag = true;
+      break;
+
+    case WALK_OPTION:
+      if (walk_dir_count == walk_dir_alloc)
+	walk_dirs = x2nrealloc (walk_dirs, &walk_dir_alloc,
+				sizeof walk_dirs[0]);
+      walk_dirs[walk_dir_count++] = arg;
+      break;
+
     case 'l':		/* Link files when possible.  */
       link_flag = true;
       break;
@@ -600,10 +712,97 @@ crc newc odc bin ustar tar (all-caps also recognized)"), arg));
       sparse_flag = true;
       break;
 
+    case PREALLOCATE_OPTION:
+      preallocate_flag = true;
+      break;
+
+    case DIRECT_IO_OPTION:
+      direct_io_flag = true;
+      break;
+
+    case COMPRESS_OPTION:
+      compress_option = find_compression_method (arg);
+      if (compress_option == compress_none)
+	USAGE_ERROR ((0, 0, _("unknown compression method: %s"), arg));
+      if (!compression_supported (compress_option))
+	USAGE_ERROR ((0, 0,
+		      _("%s compression is not supported by this build of cpio"),
+		      arg));
+      break;
+
+    case DEDUP_OPTION:
+      dedup_flag = true;
+      break;
+
+    case DATA_FIRST_LINKS_OPTION:
+      data_first_links_flag = true;
+      break;
+
+    case DATA_ALIGN_OPTION:
+      {
+	unsigned long n;
+	char *p;
+
+	errno = 0;
+	n = strtoul (arg, &p, 10);
+	if (errno || *p || n < 4 || n > 4096 || (n & (n - 1)))
+	  USAGE_ERROR ((0, 0, _("invalid alignment: %s"), arg));
+	data_align_option = n;
+      }
+      break;
+
+    case SPARSE_MAP_OPTION:
+      sparse_map_flag = true;
+      break;
+
+    case NANOSECONDS_OPTION:
+      nanoseconds_flag = true;
+      break;
+
+    case EXTENDED_HEADERS_OPTION:
+      extended_headers_flag = true;
+      break;
+
+    case LISTED_INCREMENTAL_OPTION:
+      listed_incremental_option = arg;
+      break;
+
+    case INCREMENTAL_OPTION:
+      incremental_flag = true;
+      break;
+
+    case SEEKABLE_OPTION:
+      seekable_flag = true;
+      if (arg)
+	{
+	  unsigned long n;
+	  char *p;
+
+	  errno = 0;
+	  n = strtoul (arg, &p, 10);
+	  if (errno || *p || n > 1024)
+	    USAGE_ERROR ((0, 0, _("invalid frame size: %s"), arg));
+	  seekable_frame_size = (off_t) n * 1024 * 1024;
+	}
+      break;
+
     case FORCE_LOCAL_OPTION:
       force_local_option = 1;
       break;
 
+    case LINK_MEMORY_OPTION:
+      {
+	unsigned long n;
+	char *p;
+
+	errno = 0;
+	n = strtoul (arg, &p, 10);
+	if (errno || *p || n == 0 || n > SIZE_MAX / (1024 * 1024))
+	  USAGE_ERROR ((0, 0, _("invalid memory size: %s"), arg));
+	link_memory_limit = n * 1024 * 1024;
+      }
+      break;
+
 #ifdef DEBUG_CPIO
     case DEBUG_OPTION:
       debug_flag = true;
@@ -674,6 +873,21 @@ process_args (int argc, char *argv[])
       CHECK_USAGE (output_archive_name, "-O", "--extract");
       CHECK_USAGE (renumber_inodes_option, "--renumber-inodes", "--extract");
       CHECK_USAGE (ignore_devno_option, "--ignore-devno", "--extract");
+      CHECK_USAGE (prefetch_option, "--prefetch", "--extract");
+      CHECK_USAGE (walk_dir_count, "--walk", "--extract");
+      CHECK_USAGE (cached_stat_flag, "--cached-stat", "--extract");
+      CHECK_USAGE (sort_option, "--sort", "--extract");
+      CHECK_USAGE (reorder_flag, "--reorder", "--extract");
+      CHECK_USAGE (compress_option, "--compress", "--extract");
+      CHECK_USAGE (seekable_flag, "--seekable", "--extract");
+      CHECK_USAGE (dedup_flag, "--dedup", "--extract");
+      CHECK_USAGE (data_first_links_flag, "--data-first-links", "--extract");
+      CHECK_USAGE (data_align_option, "--data-align", "--extract");
+      CHECK_USAGE (sparse_map_flag, "--sparse-map", "--extract");
+      CHECK_USAGE (nanoseconds_flag, "--nanoseconds", "--extract");
+      CHECK_USAGE (extended_headers_flag, "--extended-headers", "--extract");
+      CHECK_USAGE (listed_incremental_option, "--listed-incremental",
+		   "--extract");
       if (to_stdout_option)
 	{
 	  CHECK_USAGE (create_dir_flag, "--make-directories", "--to-stdout");
@@ -683,6 +897,7 @@ process_args (int argc, char *argv[])
 		       "--owner", "--to-stdout");
 	  CHECK_USAGE (retain_time_flag, "--preserve-modification-time",
 		       "--to-stdout");
+	  CHECK_USAGE (preallocate_flag, "--preallocate", "--to-stdout");
 	}
 
       if (archive_name && input_archive_name)
@@ -708,6 +923,7 @@ process_args (int argc, char *argv[])
       CHECK_USAGE (unconditional_flag, "--unconditional", "--create");
       CHECK_USAGE (link_flag, "--link", "--create");
       CHECK_USAGE (sparse_flag, "--sparse", "--create");
+      CHECK_USAGE (preallocate_flag, "--preallocate", "--create");
       CHECK_USAGE (retain_time_flag, "--preserve-modification-time",
 		   "--create");
       CHECK_USAGE (no_chown_flag, "--no-preserve-owner", "--create");
@@ -715,6 +931,16 @@ process_args (int argc, char *argv[])
       CHECK_USAGE (swap_halfwords_flag, "--swap-halfwords (--swap)",
 		   "--create");
       CHECK_USAGE (to_stdout_option, "--to-stdout", "--create");
+      CHECK_USAGE (incremental_flag, "--incremental", "--create");
+      /* In copy-out mode, --jobs sets the number of compression
+	 threads.  */
+      CHECK_USAGE (jobs_option > 1 && !compress_option, "--jobs",
+		   "--create");
+      CHECK_USAGE (append_flag && compress_option, "--append", "--compress");
+      if (seekable_flag && compress_option != compress_zstd
+	  && compress_option != compress_lz4)
+	USAGE_ERROR ((0, 0,
+		      _("--seekable requires --compress=zstd or --compress=lz4")));
 
       if (append_flag && !(archive_name || output_archive_name))
 	USAGE_ERROR ((0, 0,
@@ -729,6 +955,31 @@ process_args (int argc, char *argv[])
 
       if (archive_format == arf_unknown)
 	archive_format = arf_binary;
+      if (dedup_flag
+	  && archive_format != arf_newascii && archive_format != arf_crcascii
+	  && archive_format != arf_tar && archive_format != arf_ustar)
+	USAGE_ERROR ((0, 0,
+		      _("--dedup requires the newc, crc, tar or ustar format")));
+      if (data_first_links_flag
+	  && archive_format != arf_newascii && archive_format != arf_crcascii)
+	USAGE_ERROR ((0, 0,
+		      _("--data-first-links requires the newc or crc format")));
+      if (data_align_option
+	  && archive_format != arf_newascii && archive_format != arf_crcascii)
+	USAGE_ERROR ((0, 0,
+		      _("--data-align requires the newc or crc format")));
+      if (sparse_map_flag
+	  && archive_format != arf_newascii && archive_format != arf_crcascii)
+	USAGE_ERROR ((0, 0,
+		      _("--sparse-map requires the newc or crc format")));
+      if (nanoseconds_flag
+	  && archive_format != arf_newascii && archive_format != arf_crcascii)
+	USAGE_ERROR ((0, 0,
+		      _("--nanoseconds requires the newc or crc format")));
+      if (extended_headers_flag
+	  && archive_format != arf_newascii && archive_format != arf_crcascii)
+	USAGE_ERROR ((0, 0,
+		      _("--extended-headers requires the newc or crc format")));
       if (output_archive_name)
 	archive_name = output_archive_name;
 
@@ -760,6 +1011,20 @@ process_args (int argc, char *argv[])
       CHECK_USAGE (no_abs_paths_flag, "--absolute-pathnames",
 		   "--pass-through");
       CHECK_USAGE (to_stdout_option, "--to-stdout", "--pass-through");
+      CHECK_USAGE (jobs_option > 1, "--jobs", "--pass-through");
+      CHECK_USAGE (compress_option, "--compress", "--pass-through");
+      CHECK_USAGE (seekable_flag, "--seekable", "--pass-through");
+      CHECK_USAGE (dedup_flag, "--dedup", "--pass-through");
+      CHECK_USAGE (data_first_links_flag, "--data-first-links",
+		   "--pass-through");
+      CHECK_USAGE (data_align_option, "--data-align", "--pass-through");
+      CHECK_USAGE (sparse_map_flag, "--sparse-map", "--pass-through");
+      CHECK_USAGE (nanoseconds_flag, "--nanoseconds", "--pass-through");
+      CHECK_USAGE (extended_headers_flag, "--extended-headers",
+		   "--pass-through");
+      CHECK_USAGE (listed_incremental_option, "--listed-incremental",
+		   "--pass-through");
+      CHECK_USAGE (incremental_flag, "--incremental", "--pass-through");
       CHECK_USAGE (renumber_inodes_option, "--renumber-inodes",
 		   "--pass-through");
       CHECK_USAGE (ignore_devno_option, "--ignore-devno", "--pass-through");
@@ -767,6 +1032,9 @@ process_args (int argc, char *argv[])
       directory_name = argv[index];
     }
 
+  if (reorder_flag && sort_option == sort_none)
+    USAGE_ERROR ((0, 0, _("--reorder requires --sort")));
+
   if (archive_name)
     {
       if (copy_function != process_copy_in && copy_function != process_copy_out)
@@ -778,6 +1046,16 @@ process_args (int argc, char *argv[])
 	       quotearg_colon (archive_name));
     }
 
+  /* The compressed stream is not restarted on a new volume.  */
+  if (compress_option && copy_function == process_copy_out)
+    {
+      if (new_media_message || new_media_message_with_number)
+	USAGE_ERROR ((0, 0, _("--compress cannot be used with --message")));
+      if (archive_is_multivolume (archive_des))
+	USAGE_ERROR ((0, 0, _("--compress cannot be used with a tape "
+			      "or device archive")));
+    }
+
   /* Prevent SysV non-root users from giving away files inadvertantly.
      This happens automatically on BSD, where only root can give
      away files.  */
@@ -829,13 +1107,22 @@ initialize_buffers ()
       out_buf_size = DISK_IO_BLOCK_SIZE;
     }
 
-  input_buffer = (char *) xmalloc (in_buf_size);
+  /* O_DIRECT transfers need aligned buffers.  */
+  if (direct_io_flag)
+    {
+      input_buffer = pagealign_xalloc (in_buf_size);
+      output_buffer = pagealign_xalloc (out_buf_size);
+    }
+  else
+    {
+      input_buffer = (char *) xmalloc (in_buf_size);
+      output_buffer = (char *) xmalloc (out_buf_size);
+    }
   in_buff = input_buffer;
   input_buffer_size = in_buf_size;
   input_size = 0;
   input_bytes = 0;
 
-  output_buffer = (char *) xmalloc (out_buf_size);
   out_buff = output_buffer;
   output_size = 0;
   output_bytes = 0;
@@ -852,9 +1139,14 @@ main (int argc, char *argv[])
   argp_version_setup ("cpio", program_authors);
   process_args (argc, argv);
 
+  /* There is no archive in copy-pass mode.  */
+  if (copy_function != process_copy_pass)
+    archive_direct_io_init (archive_des, archive_name == NULL);
   initialize_buffers ();
 
   (*copy_function) ();
+  drop_deferred_file_cache ();
+  archive_direct_io_finish (archive_des);
 
   if (archive_des >= 0 && rmtclose (archive_des) == -1)
     error (PAXEXIT_FAILURE, errno, _("error closing archive"));
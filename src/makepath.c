@@ -160,9 +160,9 @@ make_path (char const *argpath,
 	   gid_t group,
 	   const char *verbose_fmt_string)
 {
-  char *dirpath = xstrdup (argpath);
+  char *dirpath = member_xstrdup (argpath);
   int retval = make_path0 (dirpath, owner, group, verbose_fmt_string);
-  free (dirpath);
+  member_free (dirpath);
   return retval;
 }
 
@@ -30,11 +30,30 @@
 #include <rmt.h>
 #include <hash.h>
 #include <utimens.h>
+#include <stat-time.h>
+#include <pagealign_alloc.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYS_IOCTL_H
 # include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
+#ifdef HAVE_LINUX_FIEMAP_H
+# include <linux/fiemap.h>
+#endif
+
+#ifdef HAVE_SYS_STATVFS_H
+# include <sys/statvfs.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
 #ifdef HAVE_SYS_MTIO_H
 # ifdef HAVE_SYS_IO_TRIOCTL_H
 #  include <sys/io/trioctl.h>
@@ -46,6 +65,778 @@
 extern int errno;
 #endif
 
+/* Page cache bypass (--direct-io).
+
+   If possible, the archive is accessed with O_DIRECT.  Otherwise, or
+   if the kernel refuses an unaligned transfer, the cached archive
+   pages are dropped each time DIRECT_IO_DROP_INTERVAL bytes have been
+   transferred.  The data of regular files go through the page cache,
+   and are dropped from it once the file is complete.
+
+   Dirty pages cannot be dropped before they are written back.  Rather
+   than waiting for that, the writeback is started, and the pages are
+   dropped later: those of the archive at the next interval, and those
+   of a written file once DIRECT_IO_DEFERRED_FILES more files have been
+   written.  */
+
+#define DIRECT_IO_DROP_INTERVAL (8 * 1024 * 1024)
+
+/* Regular files smaller than that are left alone.  */
+#define DIRECT_IO_MIN_FILE_SIZE (64 * 1024)
+
+/* The I/O block size is rounded up to a multiple of that, or of the
+   logical block size of the archive if larger, when O_DIRECT is used.  */
+#define DIRECT_IO_MIN_BLOCK_SIZE (64 * 1024)
+
+/* Number of written files whose pages are dropped later.  */
+#define DIRECT_IO_DEFERRED_FILES 8
+
+enum direct_io_mode
+  {
+    direct_io_none,		/* Archive accessed normally.  */
+    direct_io_odirect,		/* Archive opened with O_DIRECT.  */
+    direct_io_advise		/* Archive pages dropped periodically.  */
+  };
+
+static enum direct_io_mode archive_direct_io;
+static off_t archive_undropped;
+
+/* If the archive was inherited from the parent process, a duplicate of
+   its original descriptor, which the archive descriptor replaces with
+   a private one opened with O_DIRECT.  -1 otherwise.  */
+static int archive_inherited_des = -1;
+
+/* Duplicates of the descriptors of the last files written, oldest
+   first from DEFERRED_DROP_NEXT, whose pages are still to be dropped.
+   drop_file_cache is called by the --jobs workers too.  */
+static int deferred_drop[DIRECT_IO_DEFERRED_FILES];
+static size_t deferred_drop_count;
+static size_t deferred_drop_next;
+static pthread_mutex_t deferred_drop_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Drop the pages of FD from the page cache.  If it was WRITTEN, start
+   the writeback of its dirty pages, which are left in the cache.  */
+static void
+drop_cache (int fd, bool written)
+{
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
+  if (written)
+    {
+# ifdef HAVE_SYNC_FILE_RANGE
+      sync_file_range (fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+# else
+      if (fdatasync (fd))
+	return;
+# endif
+    }
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* Remember the written file FD, whose pages are dropped once
+   DIRECT_IO_DEFERRED_FILES more files have been written, and drop
+   those of the oldest file remembered.  */
+static void
+defer_drop_cache (int fd)
+{
+  int old = -1;
+  int dup_fd = dup (fd);
+
+  if (dup_fd < 0)
+    return;
+  pthread_mutex_lock (&deferred_drop_mutex);
+  if (deferred_drop_count == DIRECT_IO_DEFERRED_FILES)
+    {
+      old = deferred_drop[deferred_drop_next];
+      deferred_drop[deferred_drop_next] = dup_fd;
+      deferred_drop_next = (deferred_drop_next + 1) % DIRECT_IO_DEFERRED_FILES;
+    }
+  else
+    deferred_drop[(deferred_drop_next + deferred_drop_count++)
+		  % DIRECT_IO_DEFERRED_FILES] = dup_fd;
+  pthread_mutex_unlock (&deferred_drop_mutex);
+
+  if (old >= 0)
+    {
+      drop_cache (old, false);
+      close (old);
+    }
+}
+
+/* Drop the pages of the written files that are still remembered.  */
+void
+drop_deferred_file_cache (void)
+{
+  pthread_mutex_lock (&deferred_drop_mutex);
+  for (; deferred_drop_count; deferred_drop_count--)
+    {
+      int fd = deferred_drop[deferred_drop_next];
+      deferred_drop_next = (deferred_drop_next + 1) % DIRECT_IO_DEFERRED_FILES;
+      drop_cache (fd, false);
+      close (fd);
+    }
+  pthread_mutex_unlock (&deferred_drop_mutex);
+}
+
+#ifdef O_DIRECT
+/* Give the archive ARCHIVE_DES, which was inherited from the parent
+   process, a private open file description with O_DIRECT set, so that
+   the flag is not seen by other users of the original one.  Return
+   true on success.  */
+static bool
+archive_reopen_direct (int archive_des, int flags)
+{
+  char name[sizeof "/proc/self/fd/" + UINTMAX_STRSIZE_BOUND];
+  off_t offset = lseek (archive_des, 0, SEEK_CUR);
+  int fd;
+
+  if (offset < 0)
+    return false;
+  sprintf (name, "/proc/self/fd/%d", archive_des);
+  fd = open (name, (flags & (O_ACCMODE | O_APPEND)) | O_DIRECT | O_BINARY);
+  if (fd < 0)
+    return false;
+  if (lseek (fd, offset, SEEK_SET) != offset
+      || (archive_inherited_des = dup (archive_des)) < 0
+      || dup2 (fd, archive_des) < 0)
+    {
+      if (archive_inherited_des >= 0)
+	close (archive_inherited_des);
+      archive_inherited_des = -1;
+      close (fd);
+      return false;
+    }
+  close (fd);
+  return true;
+}
+#endif
+
+/* Set up page cache bypass for the archive ARCHIVE_DES.  INHERITED is
+   true if the archive was opened by the parent process.  When O_DIRECT
+   is used, round io_block_size up to a multiple of
+   DIRECT_IO_MIN_BLOCK_SIZE and of the logical block size of the
+   archive.  This must be called before the buffers are allocated.  */
+void
+archive_direct_io_init (int archive_des, bool inherited)
+{
+  struct stat st;
+
+  if (!direct_io_flag || archive_des < 0 || _isrmt (archive_des)
+      || fstat (archive_des, &st)
+      || !(S_ISREG (st.st_mode) || S_ISBLK (st.st_mode)))
+    return;
+
+  archive_direct_io = direct_io_advise;
+#ifdef O_DIRECT
+  /* prepare_append reads and rewrites a partial block.  */
+  if (!append_flag)
+    {
+      int flags = fcntl (archive_des, F_GETFL);
+      size_t align = DIRECT_IO_MIN_BLOCK_SIZE;
+
+      if (flags == -1)
+	return;
+      if (inherited
+	  ? !archive_reopen_direct (archive_des, flags)
+	  : fcntl (archive_des, F_SETFL, flags | O_DIRECT) != 0)
+	return;
+      archive_direct_io = direct_io_odirect;
+
+# ifdef BLKSSZGET
+      if (S_ISBLK (st.st_mode))
+	{
+	  int size;
+	  if (ioctl (archive_des, BLKSSZGET, &size) == 0 && size > 0
+	      && size > align)
+	    align = size;
+	}
+      else
+# endif
+      if (st.st_blksize > 0 && st.st_blksize > align)
+	align = st.st_blksize;
+      if (io_block_size % align)
+	io_block_size += align - io_block_size % align;
+    }
+#endif
+}
+
+/* Undo archive_direct_io_init for the archive ARCHIVE_DES before it is
+   closed: if it was inherited, leave the original descriptor at the
+   offset the private one has reached.  */
+void
+archive_direct_io_finish (int archive_des)
+{
+  if (archive_inherited_des >= 0)
+    {
+      off_t offset = lseek (archive_des, 0, SEEK_CUR);
+      if (offset >= 0)
+	lseek (archive_inherited_des, offset, SEEK_SET);
+      close (archive_inherited_des);
+      archive_inherited_des = -1;
+    }
+}
+
+/* Stop using O_DIRECT on the archive ARCHIVE_DES.  Return true if it
+   was used.  */
+bool
+archive_direct_io_off (int archive_des)
+{
+#ifdef O_DIRECT
+  if (archive_direct_io == direct_io_odirect)
+    {
+      int flags = fcntl (archive_des, F_GETFL);
+      if (flags != -1)
+	fcntl (archive_des, F_SETFL, flags & ~O_DIRECT);
+      archive_direct_io = direct_io_advise;
+      return true;
+    }
+#endif
+  return false;
+}
+
+/* Account for SIZE bytes read from or WRITTEN to the archive
+   ARCHIVE_DES.  */
+static void
+archive_transferred (int archive_des, ssize_t size, bool written)
+{
+  if (archive_direct_io == direct_io_advise && size > 0)
+    {
+      archive_undropped += size;
+      if (archive_undropped >= DIRECT_IO_DROP_INTERVAL)
+	{
+	  drop_cache (archive_des, written);
+	  archive_undropped = 0;
+	}
+    }
+}
+
+/* Read at most SIZE bytes from the archive IN_DES into BUF, without
+   decompressing them.  */
+ssize_t
+archive_raw_read (int in_des, char *buf, size_t size)
+{
+  ssize_t n = rmtread (in_des, buf, size);
+
+  /* O_DIRECT transfers must be aligned, which the last block of a
+     file, or a buffer refilled by tape_buffered_peek, might not be.  */
+  if (n == SAFE_READ_ERROR && errno == EINVAL
+      && archive_direct_io_off (in_des))
+    n = rmtread (in_des, buf, size);
+  archive_transferred (in_des, n, false);
+  return n;
+}
+
+/* Write SIZE bytes of BUF to the archive OUT_DES, as they are.  */
+ssize_t
+archive_raw_write (int out_des, char const *buf, size_t size)
+{
+  ssize_t n = rmtwrite (out_des, (char *) buf, size);
+
+  if (n < 0 && errno == EINVAL && archive_direct_io_off (out_des))
+    n = rmtwrite (out_des, (char *) buf, size);
+  archive_transferred (out_des, n, true);
+  return n;
+}
+
+/* Read at most SIZE bytes of archive data from IN_DES into BUF.  */
+static ssize_t
+archive_read (int in_des, char *buf, size_t size)
+{
+  return decompress_read (in_des, buf, size);
+}
+
+/* Write SIZE bytes of archive data from BUF to OUT_DES, compressing
+   them if requested.  */
+static ssize_t
+archive_write (int out_des, char *buf, size_t size)
+{
+  if (compress_option != compress_none)
+    return compress_write (out_des, buf, size);
+  return archive_raw_write (out_des, buf, size);
+}
+
+/* With --direct-io, drop the data of the regular file FD, of SIZE
+   bytes, from the page cache, once they have been entirely read or
+   WRITTEN.  This function can be called from any thread.  */
+void
+drop_file_cache (int fd, off_t size, bool written)
+{
+  if (direct_io_flag && size >= DIRECT_IO_MIN_FILE_SIZE)
+    {
+      drop_cache (fd, written);
+      if (written)
+	defer_drop_cache (fd);
+    }
+}
+
+/* Read-ahead of the files named in the input list (--prefetch).  */
+
+/* Bytes of each file to ask the kernel to read in advance.  Normal
+   sequential read-ahead takes care of the rest.  */
+#define PREFETCH_SIZE (8 * 1024 * 1024)
+
+/* Names read ahead from the input list, in a ring buffer of
+   `prefetch_option' entries.  */
+static dynamic_string *prefetch_ring;
+static size_t prefetch_head;
+static size_t prefetch_count;
+static bool prefetch_eof;
+
+/* Start reading the file NAME, described by ST, into the page cache,
+   if it is a regular file.  */
+static void
+prefetch_file (char const *name, struct stat const *st)
+{
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_WILLNEED
+  int fd;
+
+  /* Do not open anything else: opening a tape drive may rewind it.  */
+  if (!S_ISREG (st->st_mode) || st->st_size == 0)
+    return;
+  fd = open (name, O_RDONLY | O_BINARY | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    return;
+  posix_fadvise (fd, 0,
+		 st->st_size < PREFETCH_SIZE ? st->st_size : PREFETCH_SIZE,
+		 POSIX_FADV_WILLNEED);
+  close (fd);
+#endif
+}
+
+/* Read the next name of the list of files given on the standard
+   input, or found under the directories given with --walk, into
+   NAME.  */
+char *
+read_input_name (dynamic_string *name)
+{
+  if (walk_dir_count)
+    return walk_next_name (name);
+  return ds_fgetstr (stdin, name, name_end);
+}
+
+/* Read the next name of the list of files into NAME.  */
+static char *
+read_file_name (dynamic_string *name)
+{
+  if (dedup_flag)
+    return dedup_next_name (name);
+  return read_input_name (name);
+}
+
+/* Reading the files of the list in the order of their inodes or of
+   their data on disk (--sort).  The names are read in windows of
+   `prefetch_option' names, or SORT_WINDOW if --prefetch is not given.
+   The files of each window are read ahead into the page cache in the
+   sort order, and returned in the order of the list, or in the sort
+   order with --reorder.  */
+
+#define SORT_WINDOW 1024
+
+struct sort_entry
+{
+  dynamic_string name;
+  dev_t dev;
+  uintmax_t key;		/* Inode number or disk address.  */
+  size_t order;			/* Place in the window.  */
+  bool stat_ok;			/* True if ST is valid.  */
+  struct stat st;
+};
+
+static struct sort_entry *sort_window;
+static struct sort_entry **sort_index;	/* The window, in sort order.  */
+static size_t sort_count;
+static size_t sort_next;
+static bool sort_eof;
+
+/* Return the sort key of the file NAME, described by ST: its inode
+   number, or with --sort=extent, the disk address of its first extent.
+   Files with no data on disk, or whose extents are unknown, come
+   first.  Getting the extent costs an open and a FIEMAP ioctl per
+   file, so it is only done for files with data blocks, and only the
+   first extent is asked for.  */
+static uintmax_t
+sort_key (char const *name, struct stat const *st)
+{
+  if (sort_option == sort_inode)
+    return st->st_ino;
+#if defined HAVE_LINUX_FIEMAP_H && defined FS_IOC_FIEMAP
+  if (S_ISREG (st->st_mode) && st->st_size > 0 && st->st_blocks > 0)
+    {
+      union
+      {
+	struct fiemap map;
+	char buf[sizeof (struct fiemap) + sizeof (struct fiemap_extent)];
+      } fm;
+      int fd, rc;
+
+      fd = open (name, O_RDONLY | O_BINARY | O_NOCTTY | O_NONBLOCK
+		 | O_CLOEXEC);
+      if (fd < 0)
+	return 0;
+      memset (&fm, 0, sizeof fm);
+      fm.map.fm_length = FIEMAP_MAX_OFFSET;
+      fm.map.fm_extent_count = 1;
+      rc = ioctl (fd, FS_IOC_FIEMAP, &fm.map);
+      close (fd);
+      if (rc == 0 && fm.map.fm_mapped_extents > 0)
+	return fm.map.fm_extents[0].fe_physical;
+    }
+  return 0;
+#else
+  return st->st_ino;
+#endif
+}
+
+static int
+sort_compare (void const *a, void const *b)
+{
+  struct sort_entry const *ea = *(struct sort_entry *const *) a;
+  struct sort_entry const *eb = *(struct sort_entry *const *) b;
+
+  if (ea->dev != eb->dev)
+    return ea->dev < eb->dev ? -1 : 1;
+  if (ea->key != eb->key)
+    return ea->key < eb->key ? -1 : 1;
+  return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+/* Read the next window of names, sort it and start reading its files
+   into the page cache.  */
+static void
+sort_fill (void)
+{
+  size_t window = prefetch_option ? prefetch_option : SORT_WINDOW;
+  size_t i;
+
+  if (!sort_window)
+    {
+      sort_window = xcalloc (window, sizeof sort_window[0]);
+      sort_index = xcalloc (window, sizeof sort_index[0]);
+    }
+
+  sort_count = sort_next = 0;
+  while (sort_count < window)
+    {
+      struct sort_entry *e = &sort_window[sort_count];
+
+      if (read_file_name (&e->name) == NULL)
+	{
+	  sort_eof = true;
+	  break;
+	}
+      e->order = sort_count;
+      e->dev = 0;
+      e->key = 0;
+      e->stat_ok = (e->name.ds_string[0]
+		    && stat_input_file_ahead (e->name.ds_string,
+					      &e->st) == 0);
+      if (e->stat_ok)
+	{
+	  e->dev = e->st.st_dev;
+	  e->key = sort_key (e->name.ds_string, &e->st);
+	}
+      sort_index[sort_count++] = e;
+    }
+
+  qsort (sort_index, sort_count, sizeof sort_index[0], sort_compare);
+  if (!reorder_flag || prefetch_option)
+    for (i = 0; i < sort_count; i++)
+      if (sort_index[i]->stat_ok)
+	prefetch_file (sort_index[i]->name.ds_string, &sort_index[i]->st);
+}
+
+/* Get the next name from the list of files into NAME, with --sort.  */
+static char *
+get_next_sorted_name (dynamic_string *name)
+{
+  struct sort_entry *e;
+  dynamic_string tmp;
+
+  if (sort_next == sort_count)
+    {
+      if (sort_eof)
+	return NULL;
+      sort_fill ();
+      if (sort_count == 0)
+	return NULL;
+    }
+
+  e = reorder_flag ? sort_index[sort_next] : &sort_window[sort_next];
+  sort_next++;
+  tmp = *name;
+  *name = e->name;
+  e->name = tmp;
+  return name->ds_string;
+}
+
+/* Get the next name from the list of files to copy into NAME.  With
+   --prefetch, keep `prefetch_option' names ahead of the one returned,
+   and have the kernel read those files while the current one is being
+   copied.  Return NULL at the end of the list.  */
+char *
+get_next_file_name (dynamic_string *name)
+{
+  dynamic_string tmp;
+
+  if (sort_option != sort_none)
+    return get_next_sorted_name (name);
+
+  if (!prefetch_option)
+    return read_file_name (name);
+
+  if (!prefetch_ring)
+    prefetch_ring = xcalloc (prefetch_option, sizeof prefetch_ring[0]);
+
+  while (!prefetch_eof && prefetch_count < prefetch_option)
+    {
+      dynamic_string *next =
+	&prefetch_ring[(prefetch_head + prefetch_count) % prefetch_option];
+
+      if (read_file_name (next) == NULL)
+	prefetch_eof = true;
+      else
+	{
+	  struct stat st;
+
+	  prefetch_count++;
+	  if (next->ds_string[0]
+	      && stat_input_file_ahead (next->ds_string, &st) == 0)
+	    prefetch_file (next->ds_string, &st);
+	}
+    }
+
+  if (prefetch_count == 0)
+    return NULL;
+
+  /* Swap the storage of NAME with that of the ring entry.  */
+  tmp = *name;
+  *name = prefetch_ring[prefetch_head];
+  prefetch_ring[prefetch_head] = tmp;
+  prefetch_head = (prefetch_head + 1) % prefetch_option;
+  prefetch_count--;
+  return name->ds_string;
+}
+
+#ifdef HAVE_STATX
+/* True if the kernel does not support statx.  */
+static bool statx_missing;
+
+/* Return the statx fields needed from the files to copy.  All the
+   formats store the type, permissions, owner, size and modification
+   time of the files, and use their inode number and link count.  The
+   access time is needed only to restore it, and the status change
+   time only for --listed-incremental.  */
+static unsigned int
+input_stat_mask (void)
+{
+  unsigned int mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID
+		      | STATX_GID | STATX_INO | STATX_SIZE | STATX_MTIME;
+
+  if (reset_time_flag
+      || (retain_time_flag && copy_function == process_copy_pass))
+    mask |= STATX_ATIME;
+  if (listed_incremental_option)
+    mask |= STATX_CTIME;
+  return mask;
+}
+
+static void
+statx_to_stat (struct statx const *stx, struct stat *st)
+{
+  memset (st, 0, sizeof *st);
+  st->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+/* Get the status of the file NAME, relative to the directory DIRFD, of
+   the files to copy into ST, following symbolic links with
+   --dereference.  Where statx is available, ask only for the fields
+   cpio uses, and with --cached-stat, accept the attributes cached by
+   network file systems.  Fall back to fstatat where statx fails for
+   lack of support.  This function can be called from any thread.  */
+int
+cpio_fstatat (int dirfd, char const *name, struct stat *st)
+{
+  int flags = xstat == lstat ? AT_SYMLINK_NOFOLLOW : 0;
+
+#ifdef HAVE_STATX
+  if (!statx_missing)
+    {
+      struct statx stx;
+
+      if (statx (dirfd, name,
+		 flags | (cached_stat_flag ? AT_STATX_DONT_SYNC : 0),
+		 input_stat_mask (), &stx) == 0)
+	{
+	  statx_to_stat (&stx, st);
+	  return 0;
+	}
+      switch (errno)
+	{
+	case ENOSYS:
+	  statx_missing = true;
+	  break;
+
+	case EPERM:
+	case EINVAL:
+	  /* Seccomp filters of some sandboxes and old libc emulations
+	     reject statx, or some of its flags, with these instead of
+	     ENOSYS.  Retry this file with fstatat.  */
+	  break;
+
+	default:
+	  return -1;
+	}
+    }
+#endif
+  return fstatat (dirfd, name, st, flags);
+}
+
+/* The status of the files of the list, found while reading the list
+   ahead or walking the directories given with --walk, kept by name
+   until stat_input_file asks for it, so that the files are not stat'ed
+   twice.  */
+struct input_stat
+{
+  char *name;
+  struct stat st;
+};
+
+static Hash_table *input_stat_table;
+
+static size_t
+input_stat_hasher (void const *entry, size_t n_buckets)
+{
+  struct input_stat const *e = entry;
+  return hash_string (e->name, n_buckets);
+}
+
+static bool
+input_stat_compare (void const *a, void const *b)
+{
+  struct input_stat const *ea = a;
+  struct input_stat const *eb = b;
+  return strcmp (ea->name, eb->name) == 0;
+}
+
+static void
+input_stat_free (void *entry)
+{
+  struct input_stat *e = entry;
+  free (e->name);
+  free (e);
+}
+
+/* Remember ST as the status of the file NAME of the list.  */
+void
+remember_input_stat (char const *name, struct stat const *st)
+{
+  struct input_stat *e, *old;
+
+  if (!input_stat_table)
+    {
+      input_stat_table = hash_initialize (0, NULL, input_stat_hasher,
+					  input_stat_compare,
+					  input_stat_free);
+      if (!input_stat_table)
+	xalloc_die ();
+    }
+  e = xmalloc (sizeof *e);
+  e->name = xstrdup (name);
+  e->st = *st;
+  old = hash_insert (input_stat_table, e);
+  if (!old)
+    xalloc_die ();
+  if (old != e)
+    {
+      /* The name is given more than once.  */
+      old->st = *st;
+      input_stat_free (e);
+    }
+}
+
+/* Get the status of the file NAME of the list of files into ST while
+   the list is read ahead of the file being copied, and keep it for
+   stat_input_file.  */
+int
+stat_input_file_ahead (char const *name, struct stat *st)
+{
+  struct input_stat key, *e;
+
+  if (input_stat_table)
+    {
+      key.name = (char *) name;
+      e = hash_lookup (input_stat_table, &key);
+      if (e)
+	{
+	  *st = e->st;
+	  return 0;
+	}
+    }
+  if (cpio_fstatat (AT_FDCWD, name, st))
+    return -1;
+  remember_input_stat (name, st);
+  return 0;
+}
+
+/* Get the status of the file NAME of the list of files into ST.  Use
+   the status found while reading the list, if any, and forget it.  */
+int
+stat_input_file (char const *name, struct stat *st)
+{
+  if (input_stat_table)
+    {
+      struct input_stat key, *e;
+
+      key.name = (char *) name;
+      e = hash_remove (input_stat_table, &key);
+      if (e)
+	{
+	  *st = e->st;
+	  input_stat_free (e);
+	  return 0;
+	}
+    }
+  return cpio_fstatat (AT_FDCWD, name, st);
+}
+
+/* Tell the kernel that the regular file FD is going to be read
+   sequentially.  */
+void
+advise_sequential (int fd)
+{
+#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/* Offset in the archive of the first byte written to it, minus
+   `output_bytes' at that time.  Only nonzero when appending.  */
+static off_t output_start;
+
+/* Return the offset in the archive, before compression, of the next
+   byte stored in the output buffer.  */
+off_t
+tape_output_offset (void)
+{
+  return output_start + output_bytes + output_size;
+}
+
 /* Write `output_size' bytes of `output_buffer' to file
    descriptor OUT_DES and reset `output_size' and `out_buff'.  */
 
@@ -69,7 +860,7 @@ tape_empty_output_buffer (int out_des)
     }
 #endif
 
-  bytes_written = rmtwrite (out_des, output_buffer, output_size);
+  bytes_written = archive_write (out_des, output_buffer, output_size);
   if (bytes_written != output_size)
     {
       int rest_bytes_written;
@@ -149,6 +940,62 @@ disk_empty_output_buffer (int out_des, bool flush)
   output_size = 0;
 }
 
+/* Write SIZE bytes of BUF to file descriptor OUT_DES, bypassing the
+   output buffer, which must be empty.  */
+
+static void
+disk_write_through (int out_des, char const *buf, size_t size)
+{
+  if (full_write (out_des, buf, size) != size)
+    error (PAXEXIT_FAILURE, errno, _("write error"));
+  output_bytes += size;
+}
+
+/* Move at most NUM_BYTES of member data from the archive IN_DES to the
+   file OUT_DES with splice, if the archive is read from a pipe and is
+   not compressed, so that the data do not go through user space.  The
+   input buffer must be empty.  Return the number of bytes moved, which
+   is less than NUM_BYTES if OUT_DES does not support splice or an error
+   occurred: the rest is then copied through the buffers, which reports
+   the error.  */
+
+/* Whether the archive is a pipe: 1 if it is, 0 if not, -1 if not
+   known yet.  It is found again for each reel.  */
+static int archive_is_pipe = -1;
+
+static off_t
+splice_to_disk (int in_des, int out_des, off_t num_bytes)
+{
+#ifdef HAVE_SPLICE
+  off_t done = 0;
+
+  if (archive_is_pipe < 0)
+    {
+      struct stat st;
+
+      archive_is_pipe = (!_isrmt (in_des) && fstat (in_des, &st) == 0
+			 && S_ISFIFO (st.st_mode));
+    }
+  if (!archive_is_pipe || archive_decompressing ())
+    return 0;
+
+  while (done < num_bytes)
+    {
+      off_t rest = num_bytes - done;
+      ssize_t n = splice (in_des, NULL, out_des, NULL,
+			  rest < INT_MAX ? rest : INT_MAX, SPLICE_F_MOVE);
+      if (n <= 0)
+	break;
+      done += n;
+    }
+  input_bytes += done;
+  output_bytes += done;
+  return done;
+#else
+  return 0;
+#endif
+}
+
 /* Exchange the halfwords of each element of the array of COUNT longs
    starting at PTR.  PTR does not have to be aligned at a word
    boundary.  */
@@ -197,7 +1044,7 @@ tape_fill_input_buffer (int in_des, int num_bytes)
 #endif
   in_buff = input_buffer;
   num_bytes = (num_bytes < io_block_size) ? num_bytes : io_block_size;
-  input_size = rmtread (in_des, input_buffer, num_bytes);
+  input_size = archive_read (in_des, input_buffer, num_bytes);
   if (input_size == 0 && input_is_special)
     {
       get_next_reel (in_des);
@@ -358,7 +1205,7 @@ tape_buffered_peek (char *peek_buf, int in_des, int num_bytes)
 	  in_buff = in_buff - half;
 	  append_buf = append_buf - half;
 	}
-      tmp_input_size = rmtread (in_des, append_buf, io_block_size);
+      tmp_input_size = archive_read (in_des, append_buf, io_block_size);
       if (tmp_input_size == 0)
 	{
 	  if (input_is_special)
@@ -381,6 +1228,39 @@ tape_buffered_peek (char *peek_buf, int in_des, int num_bytes)
   memcpy (peek_buf, in_buff, (unsigned) got_bytes);
   return got_bytes;
 }
+
+/* Put the SIZE bytes of BUF, the last ones read by tape_buffered_read,
+   back at the start of the input buffer, so that they are read again.
+   The buffer is enlarged if it cannot hold them with the rest of its
+   input.  */
+
+void
+tape_buffered_unread (char const *buf, size_t size)
+{
+  if ((size_t) (in_buff - input_buffer) < size)
+    {
+      if (input_buffer_size < size + input_size)
+	{
+	  size_t new_size = size + input_size;
+	  char *new_buffer = (direct_io_flag ? pagealign_xalloc (new_size)
+			      : xmalloc (new_size));
+
+	  memcpy (new_buffer + size, in_buff, input_size);
+	  if (direct_io_flag)
+	    pagealign_free (input_buffer);
+	  else
+	    free (input_buffer);
+	  input_buffer = new_buffer;
+	  input_buffer_size = new_size;
+	}
+      else
+	memmove (input_buffer + size, in_buff, input_size);
+      in_buff = input_buffer + size;
+    }
+  in_buff -= size;
+  memcpy (in_buff, buf, size);
+  input_size += size;
+}
 
 /* Skip the next NUM_BYTES bytes of file descriptor IN_DES.  */
 
@@ -390,6 +1270,21 @@ tape_toss_input (int in_des, off_t num_bytes)
   off_t bytes_left = num_bytes;	/* Bytes needing to be copied.  */
   off_t space_left;	/* Bytes to copy from input buffer.  */
 
+  /* In a seekable compressed archive, do not decompress the frames
+     that are skipped entirely.  */
+  if (bytes_left > input_size && archive_decompressing ()
+      && !(crc_i_flag && only_verify_crc_flag))
+    {
+      off_t skipped;
+
+      bytes_left -= input_size;
+      in_buff += input_size;
+      input_size = 0;
+      skipped = bytes_left - decompress_skip (in_des, bytes_left);
+      input_bytes += skipped;
+      bytes_left -= skipped;
+    }
+
   while (bytes_left > 0)
     {
       if (input_size == 0)
@@ -412,6 +1307,26 @@ tape_toss_input (int in_des, off_t num_bytes)
     }
 }
 
+/* Skip the next NUM_BYTES bytes of the seekable file descriptor IN_DES.
+   Bytes already in `in_buff' are consumed, the rest is skipped with
+   lseek, so that the next read starts right after the skipped data.  */
+
+void
+tape_seek_input (int in_des, off_t num_bytes)
+{
+  off_t space_left = (input_size < num_bytes) ? input_size : num_bytes;
+
+  in_buff += space_left;
+  input_size -= space_left;
+  num_bytes -= space_left;
+  if (num_bytes > 0)
+    {
+      if (lseek (in_des, num_bytes, SEEK_CUR) < 0)
+	error (PAXEXIT_FAILURE, errno, _("cannot seek on input"));
+      input_bytes += num_bytes;
+    }
+}
+
 void
 write_nuls_to_file (off_t num_bytes, int out_des,
 		    void (*writer) (char *in_buf, int out_des, off_t num_bytes))
@@ -437,32 +1352,251 @@ write_nuls_to_file (off_t num_bytes, int out_des,
    OUT_DES is the file descriptor for output;
    NUM_BYTES is the number of bytes to copy.  */
 
-void
-copy_files_tape_to_disk (int in_des, int out_des, off_t num_bytes)
+void
+copy_files_tape_to_disk (int in_des, int out_des, off_t num_bytes)
+{
+  off_t size;
+  off_t k;
+  /* Unless the data have to be swapped or searched for holes, they are
+     written straight from the input buffer, or moved from the archive
+     with splice once the buffer is empty if they are not checksummed
+     either.  */
+  bool write_through = !swapping_halfwords && !swapping_bytes
+		       && !sparse_flag;
+  bool try_splice = write_through && !crc_i_flag;
+
+  if (write_through && output_size)
+    disk_empty_output_buffer (out_des, false);
+
+  while (num_bytes > 0)
+    {
+      if (input_size == 0)
+	{
+	  if (try_splice)
+	    {
+	      num_bytes -= splice_to_disk (in_des, out_des, num_bytes);
+	      if (num_bytes == 0)
+		break;
+	      try_splice = false;
+	    }
+	  tape_fill_input_buffer (in_des, io_block_size);
+	}
+      size = (input_size < num_bytes) ? input_size : num_bytes;
+      if (crc_i_flag)
+	{
+	  for (k = 0; k < size; ++k)
+	    crc += in_buff[k] & 0xff;
+	}
+      if (write_through)
+	disk_write_through (out_des, in_buff, size);
+      else
+	disk_buffered_write (in_buff, out_des, size);
+      num_bytes -= size;
+      input_size -= size;
+      in_buff += size;
+    }
+}
+
+/* Clone the whole blocks of the next NUM_BYTES bytes of member data of
+   the archive IN_DES into the regular file OUT_DES, at its current
+   offset, with the FICLONERANGE ioctl, so that the file shares their
+   extents with the archive instead of receiving a copy of them.  This
+   is only possible if the archive is a local regular file that is not
+   compressed, the data need not be checksummed, swapped or made sparse,
+   and both offsets are multiples of the block size of the file system,
+   which is the unit of its extents, as the data offsets of the archives
+   created with --data-align can be.  The output buffer must be empty.
+   Consume the cloned data from the archive and return their size, which
+   is 0 if nothing could be cloned: the rest of the data is then copied
+   by copy_files_tape_to_disk.  */
+
+off_t
+clone_to_disk (int in_des, int out_des, off_t num_bytes)
+{
+#if HAVE_DECL_FICLONERANGE && defined HAVE_SYS_STATVFS_H
+  static bool clone_unsupported;
+  struct file_clone_range range;
+  struct stat st;
+  struct statvfs fs;
+  off_t src, dest, size, block;
+
+  if (clone_unsupported || !input_is_seekable || _isrmt (in_des)
+      || archive_decompressing () || crc_i_flag
+      || swapping_halfwords || swapping_bytes || sparse_flag)
+    return 0;
+  if (fstat (out_des, &st) != 0 || !S_ISREG (st.st_mode)
+      || fstatvfs (out_des, &fs) != 0)
+    return 0;
+  block = fs.f_frsize ? fs.f_frsize : fs.f_bsize;
+  if (block <= 0 || num_bytes < block)
+    return 0;
+
+  src = lseek (in_des, 0, SEEK_CUR);
+  dest = lseek (out_des, 0, SEEK_CUR);
+  if (src < 0 || dest < 0)
+    return 0;
+  src -= input_size;
+  if (src % block != 0 || dest % block != 0)
+    return 0;
+  size = num_bytes - num_bytes % block;
+
+  range.src_fd = in_des;
+  range.src_offset = src;
+  range.src_length = size;
+  range.dest_offset = dest;
+  if (ioctl (out_des, FICLONERANGE, &range) != 0)
+    {
+      /* Do not try again if the file systems cannot share extents.
+	 Other errors, such as EINVAL if the file system wants another
+	 alignment, only make this member be copied.  */
+      if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+	clone_unsupported = true;
+      return 0;
+    }
+  if (lseek (out_des, size, SEEK_CUR) < 0)
+    error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
+  tape_seek_input (in_des, size);
+  output_bytes += size;
+  return size;
+#else
+  return 0;
+#endif
+}
+
+/* Copy the data of the sparse member mapped by XH from the archive
+   IN_DES to OUT_DES, and make its holes.  They are skipped with lseek
+   if OUT_DES is a regular file, and written as zeros otherwise.  As
+   with copy_files_tape_to_disk, the last block is not flushed.  */
+
+void
+copy_sparse_tape_to_disk (int in_des, int out_des, struct xheader const *xh)
+{
+  struct stat st;
+  bool seekable = fstat (out_des, &st) == 0 && S_ISREG (st.st_mode);
+  off_t pos = 0;
+  size_t i;
+
+  for (i = 0; i <= xh->sparse_count; i++)
+    {
+      bool last = i == xh->sparse_count;
+      off_t offset = last ? xh->sparse_size : xh->sparse_map[i].offset;
+      off_t size;
+
+      if (offset > pos)
+	{
+	  /* A hole at the end of the file is made by writing its last
+	     byte.  */
+	  off_t hole = offset - pos - (seekable && last);
+
+	  if (seekable)
+	    {
+	      disk_empty_output_buffer (out_des, true);
+	      if (lseek (out_des, hole, SEEK_CUR) < 0)
+		error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
+	      if (last)
+		write_nuls_to_file (1, out_des, disk_buffered_write);
+	    }
+	  else
+	    write_nuls_to_file (hole, out_des, disk_buffered_write);
+	}
+      if (last)
+	break;
+      size = xh->sparse_map[i].size;
+      size -= clone_to_disk (in_des, out_des, size);
+      copy_files_tape_to_disk (in_des, out_des, size);
+      pos = offset + xh->sparse_map[i].size;
+    }
+}
+
+/* Write SIZE bytes of BUF to the archive OUT_DES, bypassing the output
+   buffer, which must be empty.  */
+
+static void
+tape_write_through (char *buf, int out_des, off_t size)
 {
-  off_t size;
-  off_t k;
+  if (archive_write (out_des, buf, size) != size)
+    error (PAXEXIT_FAILURE, errno, _("write error"));
+  output_bytes += size;
+}
 
-  while (num_bytes > 0)
+/* Write at most NUM_BYTES of the file IN_DES to the archive OUT_DES with
+   sendfile, or with splice if OUT_DES is a pipe, so that the data do
+   not go through user space.  This is only done if the archive is a
+   local file or pipe that is not compressed.  The output buffer must be
+   empty.  Return the number of bytes written, which is less than
+   NUM_BYTES if the file is shorter, an error occurred on either side,
+   or the archive does not support these calls.  Set *EOF if the end of
+   the file was reached.  */
+
+static off_t
+send_to_archive (int in_des, int out_des, off_t num_bytes, bool *eof)
+{
+  off_t done = 0;
+
+  *eof = false;
+
+#if (defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H) || defined HAVE_SPLICE
+  if (output_is_special || compress_option != compress_none)
+    return 0;
+
+  while (done < num_bytes)
     {
-      if (input_size == 0)
-	tape_fill_input_buffer (in_des, io_block_size);
-      size = (input_size < num_bytes) ? input_size : num_bytes;
-      if (crc_i_flag)
+      off_t rest = num_bytes - done;
+      size_t len = rest < INT_MAX ? rest : INT_MAX;
+      ssize_t n = -1;
+
+      errno = ENOSYS;
+# if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+      n = sendfile (out_des, in_des, NULL, len);
+# endif
+# ifdef HAVE_SPLICE
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+	n = splice (in_des, NULL, out_des, NULL, len, SPLICE_F_MOVE);
+# endif
+      if (n <= 0)
 	{
-	  for (k = 0; k < size; ++k)
-	    crc += in_buff[k] & 0xff;
+	  *eof = n == 0;
+	  break;
 	}
-      disk_buffered_write (in_buff, out_des, size);
-      num_bytes -= size;
-      input_size -= size;
-      in_buff += size;
+      archive_transferred (out_des, n, true);
+      done += n;
     }
+  output_bytes += done;
+#endif
+  return done;
 }
-/* Copy a file using the input and output buffers, which may start out
-   partly full.  After the copy, the files are not closed nor the last
-   block flushed to output, and the input buffer may still be partly
-   full.  If `crc_i_flag' is set, add each byte to `crc'.
+
+/* Report that the file FILENAME of ORIGINAL_NUM_BYTES bytes ended, if
+   EOF, or could not be read NUM_BYTES bytes before its end.  */
+
+static void
+warn_short_file (char const *filename, off_t num_bytes,
+		 off_t original_num_bytes, bool eof)
+{
+  if (eof)
+    {
+      char buf[UINTMAX_STRSIZE_BOUND];
+      error (0, 0,
+	     ngettext ("File %s shrunk by %s byte, padding with zeros",
+		       "File %s shrunk by %s bytes, padding with zeros",
+		       num_bytes),
+	     filename,  STRINGIFY_BIGINT (num_bytes, buf));
+    }
+  else
+    error (0, 0,
+	   _("Read error at byte %lld in file %s, padding with zeros"),
+	   (long long) (original_num_bytes - num_bytes), filename);
+}
+
+/* Copy a file to the archive through the output buffer, which may
+   start out partly full.  The data are read straight into the free
+   space of `out_buff', as much as the rest of the block can take, and
+   each full block is flushed to output; the input buffer is not used.
+   The whole blocks of data that follow the first one are written with
+   send_to_archive when possible.  After the copy, the files are not
+   closed nor the last block flushed to output.  If the file is shorter
+   than NUM_BYTES, the rest is padded with zeros.  If `crc_i_flag' is
+   set, add each byte to `crc'.
    IN_DES is the file descriptor for input;
    OUT_DES is the file descriptor for output;
    NUM_BYTES is the number of bytes to copy.  */
@@ -471,48 +1605,104 @@ void
 copy_files_disk_to_tape (int in_des, int out_des, off_t num_bytes,
 			 char *filename)
 {
-  off_t size;
-  off_t k;
-  int rc;
+  off_t space_left;		/* Room left in output buffer.  */
+  ssize_t size;
+  ssize_t k;
   off_t original_num_bytes;
+  bool try_send = !crc_i_flag;
 
   original_num_bytes = num_bytes;
 
   while (num_bytes > 0)
     {
-      if (input_size == 0)
-	if ((rc = disk_fill_input_buffer (in_des,
-					  num_bytes < DISK_IO_BLOCK_SIZE ?
-					  num_bytes : DISK_IO_BLOCK_SIZE)))
-	  {
-	    if (rc > 0)
-	      {
-		  char buf[UINTMAX_STRSIZE_BOUND];
-		  error (0, 0,
-			 ngettext ("File %s shrunk by %s byte, padding with zeros",
-				   "File %s shrunk by %s bytes, padding with zeros",
-				   num_bytes),
-			 filename,  STRINGIFY_BIGINT (num_bytes, buf));
-	      }
-	    else
-	      error (0, 0,
-		     _("Read error at byte %lld in file %s, padding with zeros"),
-		     (long long) (original_num_bytes - num_bytes), filename);
-	    write_nuls_to_file (num_bytes, out_des, tape_buffered_write);
-	    break;
-	  }
-      size = (input_size < num_bytes) ? input_size : num_bytes;
+      space_left = io_block_size - output_size;
+      if (space_left == 0)
+	{
+	  tape_empty_output_buffer (out_des);
+	  continue;
+	}
+      if (try_send && output_size == 0 && num_bytes >= io_block_size)
+	{
+	  bool eof;
+	  off_t sent = send_to_archive (in_des, out_des,
+					num_bytes - num_bytes % io_block_size,
+					&eof);
+	  num_bytes -= sent;
+	  try_send = false;
+	  if (sent % io_block_size != 0)
+	    {
+	      /* The copy stopped in the middle of a block.  Unless the
+		 file ended, finish the block with read and write: the
+		 call that fails tells whether it is the file or the
+		 archive, whose errors are fatal.  */
+	      space_left = io_block_size - sent % io_block_size;
+	      while (!eof && space_left > 0)
+		{
+		  size = read (in_des, out_buff, space_left);
+		  if (size <= 0)
+		    {
+		      eof = size == 0;
+		      break;
+		    }
+		  tape_write_through (out_buff, out_des, size);
+		  input_bytes += size;
+		  num_bytes -= size;
+		  space_left -= size;
+		}
+	      if (space_left == 0)
+		continue;
+
+	      /* The file ended, or could not be read.  Complete the
+		 block with zeros, so that the archive stays made of
+		 whole blocks, then pad the rest of the member.  */
+	      warn_short_file (filename, num_bytes, original_num_bytes, eof);
+	      write_nuls_to_file (space_left, out_des, tape_write_through);
+	      write_nuls_to_file (num_bytes - space_left, out_des,
+				  tape_buffered_write);
+	      break;
+	    }
+	  continue;
+	}
+      if (num_bytes < space_left)
+	space_left = num_bytes;
+      size = read (in_des, out_buff, space_left);
+      if (size <= 0)
+	{
+	  warn_short_file (filename, num_bytes, original_num_bytes, size == 0);
+	  write_nuls_to_file (num_bytes, out_des, tape_buffered_write);
+	  break;
+	}
       if (crc_i_flag)
 	{
 	  for (k = 0; k < size; ++k)
-	    crc += in_buff[k] & 0xff;
+	    crc += out_buff[k] & 0xff;
 	}
-      tape_buffered_write (in_buff, out_des, size);
+      input_bytes += size;
+      out_buff += size;
+      output_size += size;
       num_bytes -= size;
-      input_size -= size;
-      in_buff += size;
     }
 }
+
+/* Copy the data of the sparse file FILENAME, open as IN_DES and mapped
+   by XH, to the archive OUT_DES, as copy_files_disk_to_tape does: the
+   holes are left out.  */
+
+void
+copy_sparse_disk_to_tape (int in_des, int out_des, struct xheader const *xh,
+			  char *filename)
+{
+  size_t i;
+
+  for (i = 0; i < xh->sparse_count; i++)
+    {
+      if (lseek (in_des, xh->sparse_map[i].offset, SEEK_SET) < 0)
+	error (PAXEXIT_FAILURE, errno, _("%s: cannot seek"), quote (filename));
+      copy_files_disk_to_tape (in_des, out_des, xh->sparse_map[i].size,
+			       filename);
+    }
+}
+
 /* Copy a file using the input and output buffers, which may start out
    partly full.  After the copy, the files are not closed nor the last
    block flushed to output, and the input buffer may still be partly
@@ -572,7 +1762,7 @@ warn_if_file_changed (char *file_name, off_t old_file_size,
 		      time_t old_file_mtime)
 {
   struct stat new_file_stat;
-  if ((*xstat) (file_name, &new_file_stat) < 0)
+  if (cpio_fstatat (AT_FDCWD, file_name, &new_file_stat) < 0)
     {
       stat_error (file_name);
       return;
@@ -590,166 +1780,703 @@ warn_if_file_changed (char *file_name, off_t old_file_size,
   else if (new_file_stat.st_mtime != old_file_mtime)
     error (0, 0, _("File %s was modified while being copied"), file_name);
 }
-
-/* Create all directories up to but not including the last part of NAME.
-   Do not destroy any nondirectories while creating directories.  */
+
+/* Create all directories up to but not including the last part of NAME.
+   Do not destroy any nondirectories while creating directories.  */
+
+void
+create_all_directories (char const *name)
+{
+  size_t len = dir_len (name);
+  char *dir;
+
+  if (len == 0)
+    return;
+  dir = member_xmalloc (len + 1);
+  memcpy (dir, name, len);
+  dir[len] = '\0';
+
+  if (dir[0] != '.' || dir[1] != '\0')
+    {
+      const char *fmt;
+      if (warn_option & CPIO_WARN_INTERDIR)
+	fmt = _("Creating intermediate directory `%s'");
+      else
+	fmt = NULL;
+      make_path (dir, -1, -1, fmt);
+    }
+
+  member_free (dir);
+}
+
+/* Prepare to append to an archive.  We have been in
+   process_copy_in, keeping track of the position where
+   the last header started in `last_header_start'.  Now we
+   have the starting position of the last header (the TRAILER!!!
+   header, or blank record for tar archives) and we want to start
+   writing (appending) over the last header.  The last header may
+   be in the middle of a block, so to keep the buffering in sync
+   we lseek back to the start of the block, read everything up
+   to but not including the last header, lseek back to the start
+   of the block, and then do a copy_buf_out of what we read.
+   Actually, we probably don't have to worry so much about keeping the
+   buffering perfect since you can only append to archives that
+   are disk files.  */
+
+void
+prepare_append (int out_file_des)
+{
+  off_t start_of_header;
+  off_t start_of_block;
+  size_t useful_bytes_in_block;
+  char *tmp_buf;
+
+  start_of_header = last_header_start;
+  /* Figure out how many bytes we will rewrite, and where they start.  */
+  useful_bytes_in_block = start_of_header % io_block_size;
+  start_of_block = start_of_header - useful_bytes_in_block;
+
+  if (lseek (out_file_des, start_of_block, SEEK_SET) < 0)
+    error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
+  output_start = start_of_block - output_bytes;
+  if (useful_bytes_in_block > 0)
+    {
+      tmp_buf = (char *) xmalloc (useful_bytes_in_block);
+      read (out_file_des, tmp_buf, useful_bytes_in_block);
+      if (lseek (out_file_des, start_of_block, SEEK_SET) < 0)
+	error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
+      /* fix juo -- is this copy_tape_buf_out?  or copy_disk? */
+      tape_buffered_write (tmp_buf, out_file_des, useful_bytes_in_block);
+      free (tmp_buf);
+    }
+
+  /* We are done reading the archive, so clear these since they
+     will now be used for reading in files that we are appending
+     to the archive.  */
+  input_size = 0;
+  input_bytes = 0;
+  in_buff = input_buffer;
+}
+
+/* Support for remembering inodes with multiple links.  Used in the
+   "copy in" and "copy pass" modes for making links instead of copying
+   the file.
+
+   The table may have to hold an entry for most of the files of a large
+   tree, so it is kept compact.  The entries are stored in chunks of
+   INODE_CHUNK entries, as parallel arrays, and are found through an
+   open addressing index of entry numbers.  Each distinct device is
+   given a small number, which is only stored for the chunks that have
+   files on more than one device.
+
+   The file names are stored as a tree: a name is a record holding the
+   number of its directory, or 0 if it has no slash, followed by its
+   last component.  The records of the directories have the same form,
+   and are found through another open addressing index.
+
+   Once the names take more than `link_memory_limit' bytes, the records
+   of the following files are written to a temporary file instead.
+
+   Only the files with more than one link are entered.  Each entry
+   counts the links of its file that are still to be seen, and is
+   removed, with its name, once all of them have been: the table then
+   holds only the link groups that are not complete yet.  */
+
+#define INODE_CHUNK 4096
+
+struct inode_chunk
+{
+  ino_t ino[INODE_CHUNK];	/* Inode numbers.  */
+  uint32_t *dev;		/* Device numbers, or NULL if all the
+				   entries are on the first device.  */
+  uint64_t *name;		/* File names, as returned by
+				   store_link_name, or NULL if none of
+				   the entries has one.  */
+  ino_t *trans_inode;		/* Inode numbers to store in the archive,
+				   with --renumber-inodes.  */
+  uint32_t links[INODE_CHUNK];	/* Links still to be seen, INODE_KEEP if
+				   unknown, or 0 if the entry is free.  */
+};
+
+#define INODE_KEEP UINT32_MAX
+
+static struct inode_chunk **inode_chunks;
+static size_t inode_chunk_alloc;
+static size_t inode_count;	/* Number of entries ever used.  */
+static size_t inode_live;	/* Number of entries in use.  */
+
+/* The free entries are chained through their `ino' field.  The links
+   of the chain, and `inode_free', hold an entry number plus one, or 0
+   at its end.  */
+static size_t inode_free;
+
+/* Open addressing index of the entries.  Each slot holds an entry
+   number plus one, or 0 if it is free.  The number of slots is a power
+   of 2.  */
+static uint32_t *inode_index;
+static size_t inode_index_size;
+
+struct link_dev
+{
+  unsigned long major_num;
+  unsigned long minor_num;
+  uint32_t number;
+};
+
+/* Devices seen so far, and the last one looked up.  */
+static Hash_table *link_dev_table;
+static struct link_dev *last_link_dev;
+
+/* Records of the directories, indexed by their number minus one, and
+   their index, which works like `inode_index'.  */
+static char **link_dirs;
+static size_t link_dir_count;
+static size_t link_dir_alloc;
+static uint32_t *link_dir_index;
+static size_t link_dir_index_size;
+
+/* The last directory looked up, and its number.  */
+static dynamic_string last_link_dir_name;
+static uint32_t last_link_dir;
+
+/* Number of bytes of names held in memory.  */
+static size_t link_memory_used;
+
+/* Temporary file receiving the names past `link_memory_limit'.  */
+static FILE *link_spill_file;
+static bool link_spill_reading;
+
+/* A stored name is a pointer to its record in memory, or the offset of
+   the record in `link_spill_file' if LINK_NAME_SPILLED is set.  */
+#define LINK_NAME_SPILLED ((uint64_t) 1 << 63)
+
+static size_t
+mix_hash (uint64_t h)
+{
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+  return h ^ (h >> 31);
+}
+
+static size_t
+link_dev_hasher (void const *data, size_t n_buckets)
+{
+  struct link_dev const *d = data;
+  return (d->major_num * 31 + d->minor_num) % n_buckets;
+}
+
+static bool
+link_dev_compare (void const *a, void const *b)
+{
+  struct link_dev const *da = a;
+  struct link_dev const *db = b;
+  return da->major_num == db->major_num && da->minor_num == db->minor_num;
+}
+
+/* Return the number of the device MAJOR_NUM, MINOR_NUM, or 0 if it was
+   never seen and CREATE is false.  */
+static uint32_t
+link_dev_number (unsigned long major_num, unsigned long minor_num,
+		 bool create)
+{
+  struct link_dev key, *d;
+
+  if (last_link_dev && last_link_dev->major_num == major_num
+      && last_link_dev->minor_num == minor_num)
+    return last_link_dev->number;
+
+  if (!link_dev_table)
+    {
+      if (!create)
+	return 0;
+      link_dev_table = hash_initialize (0, NULL, link_dev_hasher,
+					link_dev_compare, NULL);
+      if (!link_dev_table)
+	xalloc_die ();
+    }
+
+  key.major_num = major_num;
+  key.minor_num = minor_num;
+  d = hash_lookup (link_dev_table, &key);
+  if (!d)
+    {
+      if (!create)
+	return 0;
+      d = record_xmalloc (sizeof *d);
+      *d = key;
+      d->number = hash_get_n_entries (link_dev_table) + 1;
+      if (!hash_insert (link_dev_table, d))
+	xalloc_die ();
+    }
+  last_link_dev = d;
+  return d->number;
+}
+
+/* Return a new record for the component NAME of length LEN in the
+   directory DIR.  The records of directories are never freed; those of
+   files are freed with free_link_name.  */
+static char *
+new_link_record (uint32_t dir, char const *name, size_t len, bool is_dir)
+{
+  char *rec = (is_dir ? record_xcharalloc (sizeof dir + len + 1)
+	       : xmalloc (sizeof dir + len + 1));
+
+  memcpy (rec, &dir, sizeof dir);
+  memcpy (rec + sizeof dir, name, len);
+  rec[sizeof dir + len] = '\0';
+  link_memory_used += sizeof dir + len + 1;
+  return rec;
+}
+
+static size_t
+link_dir_hash (uint32_t parent, char const *name, size_t len)
+{
+  uint64_t h = parent;
+
+  while (len--)
+    h = h * 31 + (unsigned char) *name++;
+  return mix_hash (h);
+}
+
+/* Return the slot of the directory index holding the directory NAME of
+   length LEN in PARENT, or the free slot where it would go.  */
+static uint32_t *
+link_dir_slot (uint32_t parent, char const *name, size_t len)
+{
+  size_t mask = link_dir_index_size - 1;
+  size_t i;
+
+  for (i = link_dir_hash (parent, name, len) & mask; link_dir_index[i];
+       i = (i + 1) & mask)
+    {
+      char const *rec = link_dirs[link_dir_index[i] - 1];
+      uint32_t dir;
+
+      memcpy (&dir, rec, sizeof dir);
+      rec += sizeof dir;
+      if (dir == parent && memcmp (rec, name, len) == 0 && rec[len] == '\0')
+	break;
+    }
+  return &link_dir_index[i];
+}
+
+/* Return the number of the directory NAME of length LEN in PARENT,
+   adding it if needed.  */
+static uint32_t
+link_subdir_number (uint32_t parent, char const *name, size_t len)
+{
+  uint32_t *slot;
+
+  if ((link_dir_count + 1) * 4 > link_dir_index_size * 3)
+    {
+      size_t n;
+
+      if (link_dir_count == UINT32_MAX - 1)
+	xalloc_die ();
+      free (link_dir_index);
+      link_dir_index_size = link_dir_index_size ? 2 * link_dir_index_size
+						: 256;
+      link_dir_index = xcalloc (link_dir_index_size,
+				sizeof link_dir_index[0]);
+      for (n = 0; n < link_dir_count; n++)
+	{
+	  char const *rec = link_dirs[n];
+	  uint32_t dir;
+
+	  memcpy (&dir, rec, sizeof dir);
+	  rec += sizeof dir;
+	  *link_dir_slot (dir, rec, strlen (rec)) = n + 1;
+	}
+    }
+
+  slot = link_dir_slot (parent, name, len);
+  if (!*slot)
+    {
+      if (link_dir_count == link_dir_alloc)
+	link_dirs = x2nrealloc (link_dirs, &link_dir_alloc,
+				sizeof link_dirs[0]);
+      link_dirs[link_dir_count++] = new_link_record (parent, name, len, true);
+      *slot = link_dir_count;
+      link_memory_used += sizeof link_dirs[0];
+    }
+  return *slot;
+}
+
+/* Return the number of the directory made of the first LEN bytes of
+   NAME, adding it if needed.  */
+static uint32_t
+link_dir_number (char const *name, size_t len)
+{
+  char const *end = name + len;
+  uint32_t dir = 0;
+
+  if (last_link_dir && ds_len (&last_link_dir_name) == len
+      && memcmp (last_link_dir_name.ds_string, name, len) == 0)
+    return last_link_dir;
+
+  for (;;)
+    {
+      char const *p = memchr (name, '/', end - name);
+      if (!p)
+	p = end;
+      dir = link_subdir_number (dir, name, p - name);
+      if (p == end)
+	break;
+      name = p + 1;
+    }
+
+  ds_reset (&last_link_dir_name, len);
+  memcpy (last_link_dir_name.ds_string, end - len, len);
+  last_link_dir_name.ds_string[len] = '\0';
+  last_link_dir = dir;
+  return dir;
+}
+
+/* Store FILE_NAME and return its reference.  */
+static uint64_t
+store_link_name (char const *file_name)
+{
+  char const *base = strrchr (file_name, '/');
+  uint32_t dir = 0;
+  size_t base_len;
+
+  if (base)
+    dir = link_dir_number (file_name, base++ - file_name);
+  else
+    base = file_name;
+  base_len = strlen (base);
+
+  if (link_memory_limit
+      && link_memory_used + sizeof dir + base_len + 1 > link_memory_limit)
+    {
+      off_t off;
+
+      if (!link_spill_file)
+	{
+	  link_spill_file = tmpfile ();
+	  if (!link_spill_file)
+	    error (PAXEXIT_FAILURE, errno,
+		   _("cannot create temporary file"));
+	}
+      if (link_spill_reading)
+	{
+	  fseeko (link_spill_file, 0, SEEK_END);
+	  link_spill_reading = false;
+	}
+      off = ftello (link_spill_file);
+      if (fwrite (&dir, sizeof dir, 1, link_spill_file) != 1
+	  || fwrite (base, base_len + 1, 1, link_spill_file) != 1)
+	error (PAXEXIT_FAILURE, errno, _("cannot write temporary file"));
+      return off | LINK_NAME_SPILLED;
+    }
+
+  return (uintptr_t) new_link_record (dir, base, base_len, false);
+}
+
+/* Free the name stored as NAME.  The space of the names written to the
+   temporary file is not reclaimed.  */
+static void
+free_link_name (uint64_t name)
+{
+  if (name && !(name & LINK_NAME_SPILLED))
+    {
+      char *rec = (char *) (uintptr_t) name;
+      link_memory_used -= sizeof (uint32_t) + strlen (rec + sizeof (uint32_t))
+			  + 1;
+      free (rec);
+    }
+}
 
-void
-create_all_directories (char const *name)
+/* Append the name of the directory DIR to BUF.  */
+static void
+append_link_dir (dynamic_string *buf, uint32_t dir)
 {
-  char *dir;
+  char const *rec = link_dirs[dir - 1];
+  uint32_t parent;
 
-  dir = dir_name (name);
+  memcpy (&parent, rec, sizeof parent);
+  if (parent)
+    {
+      append_link_dir (buf, parent);
+      ds_append (buf, '/');
+    }
+  ds_concat (buf, rec + sizeof parent);
+}
 
-  if (dir == NULL)
-    error (PAXEXIT_FAILURE, 0, _("virtual memory exhausted"));
+/* Return the name stored as NAME.  It is valid until the next call.  */
+static char *
+fetch_link_name (uint64_t name)
+{
+  static dynamic_string buf;
+  static dynamic_string spilled;
+  uint32_t dir;
+  char const *base;
 
-  if (dir[0] != '.' || dir[1] != '\0')
+  if (name & LINK_NAME_SPILLED)
     {
-      const char *fmt;
-      if (warn_option & CPIO_WARN_INTERDIR)
-	fmt = _("Creating intermediate directory `%s'");
-      else
-	fmt = NULL;
-      make_path (dir, -1, -1, fmt);
+      link_spill_reading = true;
+      if (fseeko (link_spill_file, name & ~LINK_NAME_SPILLED, SEEK_SET)
+	  || fread (&dir, sizeof dir, 1, link_spill_file) != 1
+	  || !ds_fgetstr (link_spill_file, &spilled, '\0'))
+	error (PAXEXIT_FAILURE, errno, _("cannot read temporary file"));
+      base = spilled.ds_string;
+    }
+  else
+    {
+      char const *rec = (char const *) (uintptr_t) name;
+      memcpy (&dir, rec, sizeof dir);
+      base = rec + sizeof dir;
     }
 
-  free (dir);
+  ds_reset (&buf, 0);
+  if (dir)
+    {
+      append_link_dir (&buf, dir);
+      ds_append (&buf, '/');
+    }
+  ds_concat (&buf, base);
+  return buf.ds_string;
 }
 
-/* Prepare to append to an archive.  We have been in
-   process_copy_in, keeping track of the position where
-   the last header started in `last_header_start'.  Now we
-   have the starting position of the last header (the TRAILER!!!
-   header, or blank record for tar archives) and we want to start
-   writing (appending) over the last header.  The last header may
-   be in the middle of a block, so to keep the buffering in sync
-   we lseek back to the start of the block, read everything up
-   to but not including the last header, lseek back to the start
-   of the block, and then do a copy_buf_out of what we read.
-   Actually, we probably don't have to worry so much about keeping the
-   buffering perfect since you can only append to archives that
-   are disk files.  */
+static size_t
+inode_hash (ino_t ino, uint32_t dev)
+{
+  return mix_hash ((uint64_t) ino + (uint64_t) dev * 0x9e3779b97f4a7c15);
+}
 
-void
-prepare_append (int out_file_des)
+/* The FIELD of the entry number N.  */
+#define INODE_AT(n, field) \
+  (inode_chunks[(n) / INODE_CHUNK]->field[(n) % INODE_CHUNK])
+
+/* Return the device number of the entry number N.  */
+static uint32_t
+inode_dev (size_t n)
 {
-  off_t start_of_header;
-  off_t start_of_block;
-  size_t useful_bytes_in_block;
-  char *tmp_buf;
+  struct inode_chunk *chunk = inode_chunks[n / INODE_CHUNK];
+  return chunk->dev ? chunk->dev[n % INODE_CHUNK] : 1;
+}
 
-  start_of_header = last_header_start;
-  /* Figure out how many bytes we will rewrite, and where they start.  */
-  useful_bytes_in_block = start_of_header % io_block_size;
-  start_of_block = start_of_header - useful_bytes_in_block;
+/* Return the slot of the index holding the entry for INO on DEV, or
+   the free slot where it would go.  */
+static uint32_t *
+inode_slot (ino_t ino, uint32_t dev)
+{
+  size_t mask = inode_index_size - 1;
+  size_t i;
 
-  if (lseek (out_file_des, start_of_block, SEEK_SET) < 0)
-    error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
-  if (useful_bytes_in_block > 0)
+  for (i = inode_hash (ino, dev) & mask; inode_index[i]; i = (i + 1) & mask)
     {
-      tmp_buf = (char *) xmalloc (useful_bytes_in_block);
-      read (out_file_des, tmp_buf, useful_bytes_in_block);
-      if (lseek (out_file_des, start_of_block, SEEK_SET) < 0)
-	error (PAXEXIT_FAILURE, errno, _("cannot seek on output"));
-      /* fix juo -- is this copy_tape_buf_out?  or copy_disk? */
-      tape_buffered_write (tmp_buf, out_file_des, useful_bytes_in_block);
-      free (tmp_buf);
+      size_t n = inode_index[i] - 1;
+      if (INODE_AT (n, ino) == ino && inode_dev (n) == dev)
+	break;
     }
-
-  /* We are done reading the archive, so clear these since they
-     will now be used for reading in files that we are appending
-     to the archive.  */
-  input_size = 0;
-  input_bytes = 0;
-  in_buff = input_buffer;
+  return &inode_index[i];
 }
 
-/* Support for remembering inodes with multiple links.  Used in the
-   "copy in" and "copy pass" modes for making links instead of copying
-   the file.  */
+/* Double the size of the index.  */
+static void
+grow_inode_index (void)
+{
+  size_t n;
+
+  free (inode_index);
+  inode_index_size = inode_index_size ? 2 * inode_index_size : 1024;
+  inode_index = xcalloc (inode_index_size, sizeof inode_index[0]);
+  for (n = 0; n < inode_count; n++)
+    if (INODE_AT (n, links))
+      *inode_slot (INODE_AT (n, ino), inode_dev (n)) = n + 1;
+}
 
-struct inode_val
+/* Remove the entry number N, which is held in SLOT.  */
+static void
+remove_inode_entry (size_t n, uint32_t *slot)
 {
-  ino_t inode;
-  unsigned long major_num;
-  unsigned long minor_num;
-  ino_t trans_inode;
-  char *file_name;
-};
+  struct inode_chunk *chunk = inode_chunks[n / INODE_CHUNK];
+  size_t mask = inode_index_size - 1;
+  size_t i = slot - inode_index;
+  size_t j;
 
-/* Inode hash table.  Allocated by first call to add_inode.  */
-static Hash_table *hash_table = NULL;
+  if (chunk->name)
+    {
+      free_link_name (chunk->name[n % INODE_CHUNK]);
+      chunk->name[n % INODE_CHUNK] = 0;
+    }
+  chunk->links[n % INODE_CHUNK] = 0;
+  chunk->ino[n % INODE_CHUNK] = inode_free;
+  inode_free = n + 1;
+  inode_live--;
+
+  /* Move back the following entries of the cluster that can no longer
+     be reached past the emptied slot.  */
+  for (j = (i + 1) & mask; inode_index[j]; j = (j + 1) & mask)
+    {
+      size_t m = inode_index[j] - 1;
+      size_t home = inode_hash (INODE_AT (m, ino), inode_dev (m)) & mask;
 
-static size_t
-inode_val_hasher (const void *val, size_t n_buckets)
-{
-  const struct inode_val *ival = val;
-  return ival->inode % n_buckets;
+      if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	  inode_index[i] = inode_index[j];
+	  i = j;
+	}
+    }
+  inode_index[i] = 0;
 }
 
-static bool
-inode_val_compare (const void *val1, const void *val2)
+/* Count one more link of the entry number N, held in SLOT, as seen, and
+   remove the entry if it was the last one.  */
+static void
+count_inode_entry_link (size_t n, uint32_t *slot)
 {
-  const struct inode_val *ival1 = val1;
-  const struct inode_val *ival2 = val2;
-  return ival1->inode == ival2->inode
-	 && ival1->major_num == ival2->major_num
-	 && ival1->minor_num == ival2->minor_num;
+  uint32_t *links = &INODE_AT (n, links);
+
+  if (*links != INODE_KEEP && --*links == 0)
+    remove_inode_entry (n, slot);
 }
 
-static struct inode_val *
-find_inode_val (ino_t node_num, unsigned long major_num,
+/* Return the slot of the index holding the entry for the inode
+   NODE_NUM on the device MAJOR_NUM, MINOR_NUM, or NULL if there is
+   none.  */
+static uint32_t *
+find_inode_slot (ino_t node_num, unsigned long major_num,
 		 unsigned long minor_num)
 {
-  struct inode_val sample;
+  uint32_t dev, *slot;
 
-  if (!hash_table)
+  if (!inode_live)
     return NULL;
-
-  sample.inode = node_num;
-  sample.major_num = major_num;
-  sample.minor_num = minor_num;
-  return hash_lookup (hash_table, &sample);
+  dev = link_dev_number (major_num, minor_num, false);
+  if (!dev)
+    return NULL;
+  slot = inode_slot (node_num, dev);
+  return *slot ? slot : NULL;
 }
 
+/* Return the name of the file already seen with the inode NODE_NUM on
+   the device MAJOR_NUM, MINOR_NUM, or NULL if there is none.  The
+   caller is taken to make one more link to it.  */
 char *
 find_inode_file (ino_t node_num, unsigned long major_num,
 		 unsigned long minor_num)
 {
-  struct inode_val *ival = find_inode_val (node_num, major_num, minor_num);
-  return ival ? ival->file_name : NULL;
+  uint32_t *slot = find_inode_slot (node_num, major_num, minor_num);
+  struct inode_chunk *chunk;
+  size_t n;
+  char *name;
+
+  if (!slot)
+    return NULL;
+  n = *slot - 1;
+  chunk = inode_chunks[n / INODE_CHUNK];
+  if (!chunk->name || !chunk->name[n % INODE_CHUNK])
+    return NULL;
+  name = fetch_link_name (chunk->name[n % INODE_CHUNK]);
+  count_inode_entry_link (n, slot);
+  return name;
+}
+
+/* Count one more link of the inode NODE_NUM on the device MAJOR_NUM,
+   MINOR_NUM as seen.  */
+void
+count_inode_link (ino_t node_num, unsigned long major_num,
+		  unsigned long minor_num)
+{
+  uint32_t *slot = find_inode_slot (node_num, major_num, minor_num);
+
+  if (slot)
+    count_inode_entry_link (*slot - 1, slot);
 }
 
-/* Associate FILE_NAME with the inode NODE_NUM.  (Insert into hash table.)  */
+/* Associate FILE_NAME with the inode NODE_NUM, which has NLINK links,
+   unless it is already in the table with a name, and return the number
+   of its entry.  */
 
 static ino_t next_inode;
 
-struct inode_val *
-add_inode (ino_t node_num, char *file_name, unsigned long major_num,
-	   unsigned long minor_num)
+static size_t
+add_inode_entry (ino_t node_num, char const *file_name,
+		 unsigned long major_num, unsigned long minor_num,
+		 size_t nlink)
 {
-  struct inode_val *temp;
-  struct inode_val *e = NULL;
+  uint32_t dev = link_dev_number (major_num, minor_num, true);
+  uint32_t *slot;
+  struct inode_chunk *chunk;
+  size_t n;
 
-  /* Create new inode record.  */
-  temp = (struct inode_val *) xmalloc (sizeof (struct inode_val));
-  temp->inode = node_num;
-  temp->major_num = major_num;
-  temp->minor_num = minor_num;
-  temp->file_name = file_name ? xstrdup (file_name) : NULL;
+  if ((inode_live + 1) * 4 > inode_index_size * 3)
+    {
+      if (inode_live == UINT32_MAX - 1)
+	xalloc_die ();
+      grow_inode_index ();
+    }
+  slot = inode_slot (node_num, dev);
+  if (*slot)
+    {
+      /* The entry of a renumbered inode is made before its name is
+	 known.  */
+      n = *slot - 1;
+      chunk = inode_chunks[n / INODE_CHUNK];
+      if (file_name && !(chunk->name && chunk->name[n % INODE_CHUNK]))
+	{
+	  if (!chunk->name)
+	    chunk->name = xcalloc (INODE_CHUNK, sizeof chunk->name[0]);
+	  chunk->name[n % INODE_CHUNK] = store_link_name (file_name);
+	}
+      return n;
+    }
 
-  if (renumber_inodes_option)
-    temp->trans_inode = next_inode++;
-  else
-    temp->trans_inode = temp->inode;
+  inode_live++;
+  if (inode_free)
+    {
+      n = inode_free - 1;
+      inode_free = INODE_AT (n, ino);
+    }
+  else if ((n = inode_count++) % INODE_CHUNK == 0)
+    {
+      if (n / INODE_CHUNK == inode_chunk_alloc)
+	inode_chunks = x2nrealloc (inode_chunks, &inode_chunk_alloc,
+				   sizeof inode_chunks[0]);
+      chunk = xmalloc (sizeof *chunk);
+      chunk->dev = NULL;
+      chunk->name = NULL;
+      chunk->trans_inode = (renumber_inodes_option
+			    ? xnmalloc (INODE_CHUNK, sizeof (ino_t))
+			    : NULL);
+      inode_chunks[n / INODE_CHUNK] = chunk;
+    }
+  chunk = inode_chunks[n / INODE_CHUNK];
+  chunk->ino[n % INODE_CHUNK] = node_num;
+  if (dev != 1 && !chunk->dev)
+    {
+      size_t i;
 
-  if (!((hash_table
-	 || (hash_table = hash_initialize (0, 0, inode_val_hasher,
-					   inode_val_compare, 0)))
-	&& (e = hash_insert (hash_table, temp))))
-    xalloc_die ();
-  return e;
+      /* All the entries of the chunk so far, including the free ones
+	 that are reused later, are on the first device.  */
+      chunk->dev = xnmalloc (INODE_CHUNK, sizeof chunk->dev[0]);
+      for (i = 0; i < INODE_CHUNK; i++)
+	chunk->dev[i] = 1;
+    }
+  if (chunk->dev)
+    chunk->dev[n % INODE_CHUNK] = dev;
+  if (file_name)
+    {
+      if (!chunk->name)
+	chunk->name = xcalloc (INODE_CHUNK, sizeof chunk->name[0]);
+      chunk->name[n % INODE_CHUNK] = store_link_name (file_name);
+    }
+  if (chunk->trans_inode)
+    chunk->trans_inode[n % INODE_CHUNK] = next_inode++;
+  chunk->links[n % INODE_CHUNK] = (nlink <= 1 ? INODE_KEEP
+				   : nlink - 1 < INODE_KEEP ? nlink - 1
+				   : INODE_KEEP - 1);
+  *slot = n + 1;
+  return n;
+}
+
+void
+add_inode (ino_t node_num, char *file_name, unsigned long major_num,
+	   unsigned long minor_num, size_t nlink)
+{
+  add_inode_entry (node_num, file_name, major_num, minor_num, nlink);
 }
 
 static void
@@ -757,15 +2484,25 @@ get_inode_and_dev (struct cpio_file_stat *hdr, struct stat *st)
 {
   if (renumber_inodes_option)
     {
-      if (st->st_nlink > 1)
+      if (st->st_nlink > 1 && !S_ISDIR (st->st_mode))
 	{
-	  struct inode_val *ival = find_inode_val (st->st_ino,
-						   major (st->st_dev),
-						   minor (st->st_dev));
-	  if (!ival)
-	    ival = add_inode (st->st_ino, NULL,
-			      major (st->st_dev), minor (st->st_dev));
-	  hdr->c_ino = ival->trans_inode;
+	  uint32_t *slot = find_inode_slot (st->st_ino, major (st->st_dev),
+					    minor (st->st_dev));
+	  if (slot)
+	    {
+	      hdr->c_ino = INODE_AT (*slot - 1, trans_inode);
+	      /* With --data-first-links, copy-out counts the link when it
+		 looks up the file holding the data.  */
+	      if (!data_first_links_flag)
+		count_inode_entry_link (*slot - 1, slot);
+	    }
+	  else
+	    {
+	      size_t n = add_inode_entry (st->st_ino, NULL,
+					  major (st->st_dev),
+					  minor (st->st_dev), st->st_nlink);
+	      hdr->c_ino = INODE_AT (n, trans_inode);
+	    }
 	}
       else
 	hdr->c_ino = next_inode++;
@@ -826,6 +2563,32 @@ tape_offline (int tape_des)
 #endif
 }
 
+/* Return true if the archive ARCHIVE_DES may span several volumes,
+   i.e. if get_next_reel may be called when the end of its medium is
+   reached: if it is a remote archive, a tape or a block device.  */
+bool
+archive_is_multivolume (int archive_des)
+{
+  struct stat st;
+
+  if (_isrmt (archive_des))
+    return true;
+  if (fstat (archive_des, &st))
+    return false;
+  if (S_ISBLK (st.st_mode))
+    return true;
+  if (S_ISCHR (st.st_mode))
+    {
+#ifdef MTIOCGET
+      struct mtget status;
+      return ioctl (archive_des, MTIOCGET, &status) == 0;
+#else
+      return true;
+#endif
+    }
+  return false;
+}
+
 /* The file on file descriptor TAPE_DES is assumed to be magnetic tape
    (or floppy disk or other device) and the end of the medium
    has been reached.  Ask the user for to mount a new "tape" to continue
@@ -920,6 +2683,7 @@ get_next_reel (int tape_des)
     error (PAXEXIT_FAILURE, 0, _("internal error: tape descriptor changed from %d to %d"),
 	   old_tape_des, tape_des);
 
+  archive_is_pipe = -1;
   ds_free (&new_name);
   fclose (tty_in);
   fclose (tty_out);
@@ -1144,6 +2908,7 @@ stat_to_cpio (struct cpio_file_stat *hdr, struct stat *st)
       hdr->c_rdev_min = 0;
     }
   hdr->c_mtime = st->st_mtime;
+  hdr->c_mtime_nsec = get_stat_mtime_ns (st);
   hdr->c_filesize = st->st_size;
   hdr->c_chksum = 0;
   hdr->c_tar_linkname = NULL;
@@ -1199,40 +2964,201 @@ cpio_to_stat (struct stat *st, struct cpio_file_stat *hdr)
 # define HAVE_FCHMOD 0
 #endif
 
+/* Return the PERMS_ flags telling restore_perms what to do with the
+   file described by HEADER, which this process has just created or
+   opened as FD.  If FD is -1, look the file up by name, without
+   following symbolic links.  The owner and the mode the file actually
+   got are compared with those recorded in HEADER, since the group of a
+   new file depends on the system and on the mount options.  */
 int
-fchown_or_chown (int fd, const char *name, uid_t uid, uid_t gid)
+output_perms (int fd, struct cpio_file_stat *header)
 {
-  if (HAVE_FCHOWN && fd != -1)
-    return fchown (fd, uid, gid);
-  else
-    return chown (name, uid, gid);
+  struct stat st;
+
+  if ((fd != -1 ? fstat (fd, &st) : lstat (header->c_name, &st)) != 0)
+    return (no_chown_flag ? 0 : PERMS_CHOWN) | PERMS_CHMOD;
+  if (!no_chown_flag
+      && (st.st_uid != CPIO_UID (header->c_uid)
+	  || st.st_gid != CPIO_GID (header->c_gid)))
+    return PERMS_CHOWN | PERMS_CHMOD;
+  if ((st.st_mode & 07777) != (header->c_mode & 07777))
+    return PERMS_CHMOD;
+  return 0;
+}
+
+/* Return the mode to create the file described by HEADER with.  If the
+   file is going to change hands, keep it private until then.
+   Otherwise, give it its final permission bits at once, so that no
+   chmod is needed.  Special bits are not given to a file before it
+   gets its final contents.  The umask is reset to 0 in copy-in and
+   copy-pass modes.  */
+static mode_t
+output_create_mode (struct cpio_file_stat *header)
+{
+  static bool euid_known;
+  static uid_t euid;
+
+  if (!euid_known)
+    {
+      euid = geteuid ();
+      euid_known = true;
+    }
+  if (!no_chown_flag && CPIO_UID (header->c_uid) != euid)
+    return S_IRUSR | S_IWUSR;
+  return header->c_mode & MODE_RWX;
 }
 
+/* Create the regular file HEADER->c_name for writing, creating its
+   directories if needed and allowed.  Store in *PERMS the flags to pass
+   to set_output_perms.  Return the file descriptor, or -1 on error.  */
 int
-fchmod_or_chmod (int fd, const char *name, mode_t mode)
+create_output_file (struct cpio_file_stat *header, int *perms)
 {
-  if (HAVE_FCHMOD && fd != -1)
-    return fchmod (fd, mode);
-  else
-    return chmod (name, mode);
+  int fd;
+
+  fd = open (header->c_name, O_CREAT | O_EXCL | O_WRONLY | O_BINARY,
+	     output_create_mode (header));
+  if (fd < 0 && errno == ENOENT && create_dir_flag)
+    {
+      create_all_directories (header->c_name);
+      fd = open (header->c_name, O_CREAT | O_EXCL | O_WRONLY | O_BINARY,
+		 output_create_mode (header));
+    }
+  if (fd < 0 && errno == EEXIST)
+    /* The file was not removed beforehand.  */
+    fd = open (header->c_name, O_CREAT | O_WRONLY | O_BINARY,
+	       S_IRUSR | S_IWUSR);
+  if (fd >= 0)
+    *perms = output_perms (fd, header);
+  return fd;
 }
 
+/* Restore the owner, mode and times of the file described by HEADER.
+   If FD is not -1, use it.  Otherwise, act on NAME relative to the
+   directory DIRFD, without following symbolic links.  PERMS tells
+   whether to change the owner and the mode.  Do not report errors:
+   store the errno values in *ERR instead.  This function does not use
+   any static state, so that it can be called from any thread.  */
 void
-set_perms (int fd, struct cpio_file_stat *header)
+restore_perms (int fd, int dirfd, char const *name,
+	       struct cpio_file_stat *header, int perms,
+	       struct perms_errors *err)
 {
-  if (!no_chown_flag)
+  memset (err, 0, sizeof *err);
+
+  if (perms & PERMS_CHOWN)
     {
       uid_t uid = CPIO_UID (header->c_uid);
       gid_t gid = CPIO_GID (header->c_gid);
-      if ((fchown_or_chown (fd, header->c_name, uid, gid) < 0)
-	  && errno != EPERM)
-	chown_error_details (header->c_name, uid, gid);
+      int rc;
+
+      if (HAVE_FCHOWN && fd != -1)
+	rc = fchown (fd, uid, gid);
+      else
+	rc = fchownat (dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+      if (rc < 0 && errno != EPERM)
+	err->chown_errno = errno;
     }
+
   /* chown may have turned off some permissions we wanted. */
-  if (fchmod_or_chmod (fd, header->c_name, header->c_mode) < 0)
-    chmod_error_details (header->c_name, header->c_mode);
+  if (perms & PERMS_CHMOD)
+    {
+      int rc;
+
+      if (HAVE_FCHMOD && fd != -1)
+	rc = fchmod (fd, header->c_mode);
+      else
+	rc = fchmodat (dirfd, name, header->c_mode, 0);
+      if (rc < 0)
+	err->chmod_errno = errno;
+    }
+
   if (retain_time_flag)
-    set_file_times (fd, header->c_name, header->c_mtime, header->c_mtime, 0);
+    {
+      struct timespec ts[2];
+
+      memset (&ts, 0, sizeof ts);
+      ts[0].tv_sec = ts[1].tv_sec = header->c_mtime;
+      ts[0].tv_nsec = ts[1].tv_nsec = header->c_mtime_nsec;
+      if (fdutimensat (fd, dirfd, name, ts,
+		       fd == -1 ? AT_SYMLINK_NOFOLLOW : 0) < 0
+	  && errno != EROFS)
+	err->utime_errno = errno;
+    }
+}
+
+/* Report the errors stored by restore_perms for HEADER.  */
+void
+report_perms_errors (struct cpio_file_stat *header,
+		     struct perms_errors const *err)
+{
+  if (err->chown_errno)
+    {
+      errno = err->chown_errno;
+      chown_error_details (header->c_name, CPIO_UID (header->c_uid),
+			   CPIO_GID (header->c_gid));
+    }
+  if (err->chmod_errno)
+    {
+      errno = err->chmod_errno;
+      chmod_error_details (header->c_name, header->c_mode);
+    }
+  if (err->utime_errno)
+    {
+      errno = err->utime_errno;
+      utime_error (header->c_name);
+    }
+}
+
+/* Restore the metadata of the file HEADER, just created by this process
+   and open as FD (or -1).  PERMS is as returned by output_perms.  */
+void
+set_output_perms (int fd, struct cpio_file_stat *header, int perms)
+{
+  struct perms_errors err;
+
+  restore_perms (fd, AT_FDCWD, header->c_name, header, perms, &err);
+  report_perms_errors (header, &err);
+}
+
+/* Reserve SIZE bytes of disk space for the regular file NAME, open as
+   FD, before its data are written, so that the file system can
+   allocate them contiguously.  The size of the file is left alone, so
+   that it does not grow past the data actually written.  This is only
+   a hint: do nothing if the file system does not support it.  There is
+   no fallback to posix_fallocate, which would write the blocks
+   itself.  */
+void
+preallocate_output (int fd, char const *name, off_t size)
+{
+  int rc = 0;
+
+  if (size == 0)
+    return;
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  if (fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, size))
+    rc = errno;
+#endif
+  switch (rc)
+    {
+    case 0:
+    case EOPNOTSUPP:
+    case ENOSYS:
+    case EINVAL:
+      break;
+
+    default:
+      error (0, rc, _("cannot preallocate space for %s"), quote (name));
+    }
+}
+
+/* Restore the metadata of the file HEADER, which is open as FD, or
+   which may be a preexisting file if FD is -1.  */
+void
+set_perms (int fd, struct cpio_file_stat *header)
+{
+  set_output_perms (fd, header,
+		    (no_chown_flag ? 0 : PERMS_CHOWN) | PERMS_CHMOD);
 }
 
 void
@@ -1314,23 +3240,79 @@ struct delayed_set_stat
     struct delayed_set_stat *next;
     struct cpio_file_stat stat;
     mode_t invert_permissions;
+    int perms;			/* PERMS_ flags for restore_perms.  */
   };
 
 static struct delayed_set_stat *delayed_set_stat_head;
+static size_t delayed_set_stat_count;
+
+/* Delayed set_stat entries, indexed by name.  */
+static Hash_table *delayed_set_stat_table;
+
+static size_t
+delayed_set_stat_hasher (void const *entry, size_t n_buckets)
+{
+  struct delayed_set_stat const *data = entry;
+  return hash_string (data->stat.c_name, n_buckets);
+}
+
+static bool
+delayed_set_stat_compare (void const *a, void const *b)
+{
+  struct delayed_set_stat const *da = a;
+  struct delayed_set_stat const *db = b;
+  return strcmp (da->stat.c_name, db->stat.c_name) == 0;
+}
+
+static struct delayed_set_stat *
+find_delayed_set_stat (char const *name)
+{
+  struct delayed_set_stat key;
+
+  if (!delayed_set_stat_table)
+    return NULL;
+  key.stat.c_name = (char *) name;
+  return hash_lookup (delayed_set_stat_table, &key);
+}
 
 void
 delay_cpio_set_stat (struct cpio_file_stat *file_stat,
-		     mode_t invert_permissions)
+		     mode_t invert_permissions, int perms)
 {
   size_t file_name_len = strlen (file_stat->c_name);
-  struct delayed_set_stat *data =
-    xmalloc (sizeof (struct delayed_set_stat) + file_name_len + 1);
+  struct delayed_set_stat *data = find_delayed_set_stat (file_stat->c_name);
+
+  if (data)
+    {
+      /* The same directory was met twice.  */
+      memcpy (&data->stat, file_stat,
+	      offsetof (struct cpio_file_stat, c_name));
+      data->invert_permissions = invert_permissions;
+      data->perms = perms;
+      return;
+    }
+
+  if (!delayed_set_stat_table)
+    {
+      delayed_set_stat_table = hash_initialize (0, NULL,
+						delayed_set_stat_hasher,
+						delayed_set_stat_compare,
+						NULL);
+      if (!delayed_set_stat_table)
+	xalloc_die ();
+    }
+
+  data = xmalloc (sizeof (struct delayed_set_stat) + file_name_len + 1);
   data->next = delayed_set_stat_head;
   memcpy (&data->stat, file_stat, sizeof data->stat);
   data->stat.c_name = (char*) (data + 1);
   strcpy (data->stat.c_name, file_stat->c_name);
   data->invert_permissions = invert_permissions;
+  data->perms = perms;
   delayed_set_stat_head = data;
+  delayed_set_stat_count++;
+  if (!hash_insert (delayed_set_stat_table, data))
+    xalloc_die ();
 }
 
 void
@@ -1341,7 +3323,8 @@ delay_set_stat (char const *file_name, struct stat *st,
 
   stat_to_cpio (&fs, st);
   fs.c_name = (char*) file_name;
-  delay_cpio_set_stat (&fs, invert_permissions);
+  delay_cpio_set_stat (&fs, invert_permissions,
+		       (no_chown_flag ? 0 : PERMS_CHOWN) | PERMS_CHMOD);
 }
 
 /* Update the delayed_set_stat info for an intermediate directory
@@ -1375,71 +3358,155 @@ repair_inter_delayed_set_stat (struct stat *dir_stat_info)
 }
 
 /* Update the delayed_set_stat info for a directory matching
-   FILE_HDR.
+   FILE_HDR.  PERMS is as returned by output_perms for it.
 
    Return 0 if such info was found, 1 otherwise. */
 int
-repair_delayed_set_stat (struct cpio_file_stat *file_hdr)
+repair_delayed_set_stat (struct cpio_file_stat *file_hdr, int perms)
 {
-  struct delayed_set_stat *data;
-  for (data = delayed_set_stat_head; data; data = data->next)
+  struct delayed_set_stat *data = find_delayed_set_stat (file_hdr->c_name);
+  if (data)
     {
-      if (strcmp (file_hdr->c_name, data->stat.c_name) == 0)
-	{
-	  data->invert_permissions = 0;
-	  memcpy (&data->stat, file_hdr,
-		  offsetof (struct cpio_file_stat, c_name));
-	  return 0;
-	}
+      data->invert_permissions = 0;
+      data->perms = perms;
+      memcpy (&data->stat, file_hdr,
+	      offsetof (struct cpio_file_stat, c_name));
+      return 0;
     }
   return 1;
 }
 
+static size_t
+name_depth (char const *name)
+{
+  size_t depth = 0;
+  for (; *name; name++)
+    if (*name == '/')
+      depth++;
+  return depth;
+}
+
+/* Order delayed set_stat entries so that subdirectories come before
+   their parents, and entries of the same directory are adjacent.  */
+static int
+delayed_set_stat_order (void const *a, void const *b)
+{
+  struct delayed_set_stat const *da = *(struct delayed_set_stat * const *) a;
+  struct delayed_set_stat const *db = *(struct delayed_set_stat * const *) b;
+  size_t depth_a = name_depth (da->stat.c_name);
+  size_t depth_b = name_depth (db->stat.c_name);
+
+  if (depth_a != depth_b)
+    return depth_a < depth_b ? 1 : -1;
+  return strcmp (da->stat.c_name, db->stat.c_name);
+}
+
+/* Return true if the files A and B are in the same directory.  */
+static bool
+same_dir (char const *a, char const *b)
+{
+  char const *sa = strrchr (a, '/');
+  char const *sb = strrchr (b, '/');
+  size_t len = sa ? sa - a : 0;
+
+  return (sb ? sb - b : 0) == len && (!sa) == (!sb)
+	 && memcmp (a, b, len) == 0;
+}
+
+/* Restore the metadata of all delayed directories in a single pass.
+   The entries are sorted so that a directory is handled before its
+   parent, whose restored permissions might otherwise deny access to
+   it.  Entries are addressed relative to a descriptor of their parent
+   directory, which is opened once for all of its subdirectories, if
+   there are several.  */
 void
 apply_delayed_set_stat ()
 {
-  while (delayed_set_stat_head)
+  struct delayed_set_stat **list;
+  struct delayed_set_stat *data, *next;
+  char *dir_name = NULL;
+  int dirfd = AT_FDCWD;
+  size_t count;
+  size_t i;
+
+  if (!delayed_set_stat_head)
+    return;
+
+  list = xnmalloc (delayed_set_stat_count, sizeof list[0]);
+  for (count = 0, data = delayed_set_stat_head; data; data = next)
+    {
+      next = data->next;
+      if (data->perms || retain_time_flag)
+	list[count++] = data;
+      else
+	free (data);
+    }
+  qsort (list, count, sizeof list[0], delayed_set_stat_order);
+
+  for (i = 0; i < count; i++)
     {
-      struct delayed_set_stat *data = delayed_set_stat_head;
+      struct perms_errors err;
+      char const *name;
+      char const *slash;
+
+      data = list[i];
       if (data->invert_permissions)
 	{
 	  data->stat.c_mode ^= data->invert_permissions;
 	}
-      set_perms (-1, &data->stat);
-      delayed_set_stat_head = data->next;
-      free (data);
+
+      name = data->stat.c_name;
+      slash = strrchr (name, '/');
+      if (dirfd != AT_FDCWD && !same_dir (name, list[i-1]->stat.c_name))
+	{
+	  close (dirfd);
+	  dirfd = AT_FDCWD;
+	}
+      if (dirfd == AT_FDCWD && slash
+	  && i + 1 < count && same_dir (name, list[i+1]->stat.c_name))
+	{
+	  size_t len = slash - name;
+
+	  dir_name = xrealloc (dir_name, len + 1);
+	  memcpy (dir_name, name, len);
+	  dir_name[len] = 0;
+	  dirfd = open (len ? dir_name : "/",
+			O_RDONLY | O_DIRECTORY | O_BINARY);
+	  if (dirfd < 0)
+	    dirfd = AT_FDCWD;
+	}
+      if (dirfd != AT_FDCWD)
+	name = slash + 1;
+
+      restore_perms (-1, dirfd, name, &data->stat, data->perms, &err);
+      report_perms_errors (&data->stat, &err);
     }
+
+  if (dirfd != AT_FDCWD)
+    close (dirfd);
+  free (dir_name);
+  for (i = 0; i < count; i++)
+    free (list[i]);
+  free (list);
+  delayed_set_stat_head = NULL;
+  delayed_set_stat_count = 0;
+  hash_clear (delayed_set_stat_table);
 }
 
 
 static int
-cpio_mkdir (struct cpio_file_stat *file_hdr, int *setstat_delayed)
+cpio_mkdir (struct cpio_file_stat *file_hdr)
 {
-  int rc;
-  mode_t mode = file_hdr->c_mode;
-
-  if (!(file_hdr->c_mode & S_IWUSR))
-    {
-      rc = mkdir (file_hdr->c_name, mode | S_IWUSR);
-      if (rc == 0)
-	{
-	  delay_cpio_set_stat (file_hdr, 0);
-	  *setstat_delayed = 1;
-	}
-    }
-  else
-    {
-      rc = mkdir (file_hdr->c_name, mode);
-      *setstat_delayed = 0;
-    }
-  return rc;
+  /* A directory that is not writable by its owner is made writable
+     until its contents are extracted.  */
+  return mkdir (file_hdr->c_name, file_hdr->c_mode | S_IWUSR);
 }
 
 int
 cpio_create_dir (struct cpio_file_stat *file_hdr, int existing_dir)
 {
   int res;			/* Result of various function calls.  */
-  int setstat_delayed = 0;
+  int perms;
 
   if (to_stdout_option)
     return 0;
@@ -1458,13 +3525,13 @@ cpio_create_dir (struct cpio_file_stat *file_hdr, int existing_dir)
     }
 
   if (!existing_dir)
-    res = cpio_mkdir (file_hdr, &setstat_delayed);
+    res = cpio_mkdir (file_hdr);
   else
     res = 0;
   if (res < 0 && create_dir_flag)
     {
       create_all_directories (file_hdr->c_name);
-      res = cpio_mkdir (file_hdr, &setstat_delayed);
+      res = cpio_mkdir (file_hdr);
     }
   if (res < 0)
     {
@@ -1492,8 +3559,15 @@ cpio_create_dir (struct cpio_file_stat *file_hdr, int existing_dir)
 	}
     }
 
-  if (!setstat_delayed && repair_delayed_set_stat (file_hdr))
-    set_perms (-1, file_hdr);
+  /* The metadata of directories are restored in a single pass at the
+     end, so that creating their contents does not change their times,
+     and restrictive permissions do not get in the way.  A directory
+     that already has the right owner and mode is only delayed for its
+     times.  */
+  perms = output_perms (-1, file_hdr);
+  if (repair_delayed_set_stat (file_hdr, perms)
+      && (perms || retain_time_flag))
+    delay_cpio_set_stat (file_hdr, 0, perms);
   return 0;
 }
 
@@ -0,0 +1,572 @@
+/* walk.c - walk directory trees for copy-out and copy-pass modes
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* With --walk=DIR, the list of files is not read from the standard
+   input: it is made of DIR and of every file below it, in the order
+   `find DIR' would give if each directory listed its entries sorted
+   by name.
+
+   The main thread returns the names in that order.  Reading the
+   directories is left to a pool of worker threads: each of them reads
+   all the entries of a directory, gets their status relative to the
+   directory, and sorts them.  When the main thread
+   starts returning the entries of a directory, its subdirectories are
+   queued for the workers, ahead of the directories queued before, so
+   that the queue follows the order in which the main thread will need
+   them.  At most WALK_MAX_AHEAD directories are read in advance.  If
+   the main thread needs a directory that no worker has started
+   reading, it reads it itself.
+
+   Each directory is opened relative to a descriptor of its parent,
+   which is kept open until the parent is done with, if it has
+   subdirectories.  Symbolic links are not followed, unless with
+   --dereference, and a directory that is not the one whose status was
+   taken when its parent was read is not read.
+
+   The status of each file is kept with remember_input_stat, for
+   stat_input_file, so that the files are not stat'ed twice.
+
+   Errors found by the workers are recorded in the directory, and
+   reported by the main thread, since the error reporting functions are
+   not thread-safe.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "cpiohdr.h"
+#include "dstring.h"
+#include "extern.h"
+#include <paxlib.h>
+
+/* Number of worker threads.  */
+#define WALK_THREADS 4
+
+/* Maximum number of directories read in advance.  */
+#define WALK_MAX_AHEAD 256
+
+/* Size of the buffer used to read directory entries.  */
+#define WALK_BUFFER_SIZE (256 * 1024)
+
+/* An entry of a directory.  */
+struct walk_entry
+{
+  char *name;			/* Name in the directory.  */
+  int stat_errno;		/* Error from stat, or 0 if ST is valid.  */
+  bool loop;			/* True if it is one of its own ancestors.  */
+  struct walk_dir *dir;		/* The directory to descend into, if any.  */
+  struct stat st;
+};
+
+enum walk_dir_state
+  {
+    walk_queued,		/* Waiting for a worker.  */
+    walk_reading,		/* Being read.  */
+    walk_read			/* Entries are available.  */
+  };
+
+/* A directory to read.  */
+struct walk_dir
+{
+  struct walk_dir *prev;	/* Links in the queue.  */
+  struct walk_dir *next;
+  struct walk_dir *parent;	/* Directory it was found in, if any.  */
+  char *path;			/* Name, as given to the caller.  */
+  dev_t dev;			/* Device and inode numbers, to detect */
+  ino_t ino;			/* loops with --dereference.  */
+  enum walk_dir_state state;
+  int fd;			/* Descriptor kept for its subdirectories.  */
+  int error;			/* Error from opening or reading it.  */
+  bool replaced;		/* True if it is not the directory found.  */
+  struct walk_entry *entries;	/* Sorted entries.  */
+  size_t count;
+};
+
+/* A directory whose entries are being returned.  */
+struct walk_frame
+{
+  struct walk_dir *dir;
+  size_t next;			/* Index of the next entry to return.  */
+};
+
+static pthread_mutex_t walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t walk_read_cond = PTHREAD_COND_INITIALIZER;
+
+/* Directories waiting for a worker, in the order they will be
+   needed.  */
+static struct walk_dir *queue_head;
+static struct walk_dir *queue_tail;
+/* Number of directories read, or being read, and not yet returned.  */
+static size_t walk_ahead;
+static bool walk_shutdown;
+
+static pthread_t *walkers;
+static size_t walker_count;
+static bool walk_started;
+static char *main_buffer;		/* Buffer of the main thread.  */
+
+static struct walk_frame *stack;	/* Directories being returned.  */
+static size_t stack_size;
+static size_t stack_alloc;
+static struct walk_dir *pending_dir;	/* Directory to push next.  */
+static size_t next_root;		/* Index in `walk_dirs'.  */
+
+#ifdef HAVE_GETDENTS64
+/* The layout of the records returned by getdents64.  */
+struct walk_dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+static int
+walk_entry_compare (void const *a, void const *b)
+{
+  struct walk_entry const *ea = a;
+  struct walk_entry const *eb = b;
+  return strcmp (ea->name, eb->name);
+}
+
+/* Add the entry NAME of the directory FD to DIR, unless it is "." or
+   "..".  */
+static void
+add_entry (struct walk_dir *dir, int fd, char const *name, size_t *alloc)
+{
+  struct walk_entry *e;
+
+  if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+    return;
+  if (dir->count == *alloc)
+    dir->entries = x2nrealloc (dir->entries, alloc, sizeof dir->entries[0]);
+  e = &dir->entries[dir->count++];
+  e->name = xstrdup (name);
+  e->stat_errno = 0;
+  e->loop = false;
+  e->dir = NULL;
+  if (cpio_fstatat (fd, name, &e->st))
+    e->stat_errno = errno;
+}
+
+/* Open DIR, relative to its parent if possible.  Return the
+   descriptor, or -1 on error.  */
+static int
+open_dir (struct walk_dir *dir)
+{
+  int flags = O_RDONLY | O_DIRECTORY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC;
+  struct stat st;
+  int fd;
+
+  if (xstat == lstat)
+    flags |= O_NOFOLLOW;
+  if (dir->parent && dir->parent->fd >= 0)
+    fd = openat (dir->parent->fd, strrchr (dir->path, '/') + 1, flags);
+  else
+    fd = open (dir->path, flags);
+  if (fd < 0)
+    {
+      dir->error = errno;
+      return -1;
+    }
+  if (fstat (fd, &st))
+    {
+      dir->error = errno;
+      close (fd);
+      return -1;
+    }
+  if (st.st_dev != dir->dev || st.st_ino != dir->ino)
+    {
+      dir->replaced = true;
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* Read the entries of DIR, get their status and sort them.  BUF is a
+   buffer of WALK_BUFFER_SIZE bytes.  Keep the directory open in
+   DIR->fd if it has subdirectories.  */
+static void
+read_dir (struct walk_dir *dir, char *buf)
+{
+  size_t alloc = 0;
+  size_t i;
+  int fd;
+
+  fd = open_dir (dir);
+  if (fd < 0)
+    return;
+
+#ifdef HAVE_GETDENTS64
+  for (;;)
+    {
+      ssize_t n = getdents64 (fd, buf, WALK_BUFFER_SIZE);
+      ssize_t off;
+
+      if (n <= 0)
+	{
+	  if (n < 0)
+	    dir->error = errno;
+	  break;
+	}
+      for (off = 0; off < n; )
+	{
+	  struct walk_dirent64 *d = (struct walk_dirent64 *) (buf + off);
+	  add_entry (dir, fd, d->d_name, &alloc);
+	  off += d->d_reclen;
+	}
+    }
+#else
+  {
+    int dup_fd = dup (fd);
+    DIR *dp = dup_fd < 0 ? NULL : fdopendir (dup_fd);
+    struct dirent *d;
+
+    if (!dp)
+      {
+	dir->error = errno;
+	if (dup_fd >= 0)
+	  close (dup_fd);
+	close (fd);
+	return;
+      }
+    while (errno = 0, (d = readdir (dp)) != NULL)
+      add_entry (dir, fd, d->d_name, &alloc);
+    if (errno)
+      dir->error = errno;
+    closedir (dp);
+  }
+#endif
+
+  for (i = 0; i < dir->count; i++)
+    if (!dir->entries[i].stat_errno && S_ISDIR (dir->entries[i].st.st_mode))
+      break;
+  if (i < dir->count)
+    dir->fd = fd;
+  else
+    close (fd);
+
+  qsort (dir->entries, dir->count, sizeof dir->entries[0],
+	 walk_entry_compare);
+}
+
+static void
+queue_remove (struct walk_dir *dir)
+{
+  if (dir->prev)
+    dir->prev->next = dir->next;
+  else
+    queue_head = dir->next;
+  if (dir->next)
+    dir->next->prev = dir->prev;
+  else
+    queue_tail = dir->prev;
+  dir->prev = dir->next = NULL;
+}
+
+/* Put the chain of directories from FIRST to LAST at the head of the
+   queue.  */
+static void
+queue_push (struct walk_dir *first, struct walk_dir *last)
+{
+  pthread_mutex_lock (&walk_mutex);
+  first->prev = NULL;
+  last->next = queue_head;
+  if (queue_head)
+    queue_head->prev = last;
+  else
+    queue_tail = last;
+  queue_head = first;
+  pthread_cond_broadcast (&walk_queue_cond);
+  pthread_mutex_unlock (&walk_mutex);
+}
+
+static void *
+walk_worker (void *arg)
+{
+  char *buf = xmalloc (WALK_BUFFER_SIZE);
+
+  pthread_mutex_lock (&walk_mutex);
+  for (;;)
+    {
+      struct walk_dir *dir;
+
+      while ((!queue_head || walk_ahead >= WALK_MAX_AHEAD) && !walk_shutdown)
+	pthread_cond_wait (&walk_queue_cond, &walk_mutex);
+      if (walk_shutdown)
+	break;
+      dir = queue_head;
+      queue_remove (dir);
+      dir->state = walk_reading;
+      walk_ahead++;
+      pthread_mutex_unlock (&walk_mutex);
+
+      read_dir (dir, buf);
+
+      pthread_mutex_lock (&walk_mutex);
+      dir->state = walk_read;
+      pthread_cond_broadcast (&walk_read_cond);
+    }
+  pthread_mutex_unlock (&walk_mutex);
+  free (buf);
+  return NULL;
+}
+
+/* Start the worker threads.  If none can be started, the main thread
+   reads all the directories itself.  */
+static void
+walk_start (void)
+{
+  size_t i;
+
+  walk_started = true;
+  main_buffer = xmalloc (WALK_BUFFER_SIZE);
+  walkers = xcalloc (WALK_THREADS, sizeof walkers[0]);
+  for (i = 0; i < WALK_THREADS; i++)
+    if (pthread_create (&walkers[i], NULL, walk_worker, NULL))
+      break;
+  walker_count = i;
+}
+
+static void
+walk_stop (void)
+{
+  size_t i;
+
+  pthread_mutex_lock (&walk_mutex);
+  walk_shutdown = true;
+  pthread_cond_broadcast (&walk_queue_cond);
+  pthread_mutex_unlock (&walk_mutex);
+  for (i = 0; i < walker_count; i++)
+    pthread_join (walkers[i], NULL);
+  free (walkers);
+  walkers = NULL;
+  walker_count = 0;
+  free (main_buffer);
+  main_buffer = NULL;
+  free (stack);
+  stack = NULL;
+  stack_alloc = 0;
+}
+
+static char *
+entry_path (char const *dir, char const *name)
+{
+  size_t len = strlen (dir);
+  char *path = xmalloc (len + strlen (name) + 2);
+
+  memcpy (path, dir, len);
+  if (len == 0 || !ISSLASH (dir[len - 1]))
+    path[len++] = '/';
+  strcpy (path + len, name);
+  return path;
+}
+
+/* Return a new directory to read, named PATH, found in PARENT (or
+   NULL), and described by ST.  */
+static struct walk_dir *
+new_dir (char *path, struct walk_dir *parent, struct stat const *st)
+{
+  struct walk_dir *dir = xzalloc (sizeof *dir);
+  dir->path = path;
+  dir->parent = parent;
+  dir->dev = st->st_dev;
+  dir->ino = st->st_ino;
+  dir->state = walk_queued;
+  dir->fd = -1;
+  return dir;
+}
+
+static void
+free_dir (struct walk_dir *dir)
+{
+  size_t i;
+
+  for (i = 0; i < dir->count; i++)
+    free (dir->entries[i].name);
+  if (dir->fd >= 0)
+    close (dir->fd);
+  free (dir->entries);
+  free (dir->path);
+  free (dir);
+}
+
+/* Return true if the directory described by ST is one of those whose
+   entries are being returned, which can only happen with
+   --dereference.  */
+static bool
+is_ancestor (struct stat const *st)
+{
+  size_t i;
+
+  for (i = 0; i < stack_size; i++)
+    if (stack[i].dir->dev == st->st_dev && stack[i].dir->ino == st->st_ino)
+      return true;
+  return false;
+}
+
+/* Start returning the entries of DIR: wait until it has been read,
+   and queue its subdirectories for the workers.  */
+static void
+push_dir (struct walk_dir *dir)
+{
+  struct walk_dir *first = NULL, *last = NULL;
+  size_t i;
+
+  pthread_mutex_lock (&walk_mutex);
+  if (dir->state == walk_queued)
+    {
+      queue_remove (dir);
+      dir->state = walk_reading;
+      pthread_mutex_unlock (&walk_mutex);
+      read_dir (dir, main_buffer);
+    }
+  else
+    {
+      while (dir->state != walk_read)
+	pthread_cond_wait (&walk_read_cond, &walk_mutex);
+      walk_ahead--;
+      pthread_cond_broadcast (&walk_queue_cond);
+      pthread_mutex_unlock (&walk_mutex);
+    }
+  dir->state = walk_read;
+
+  if (dir->error)
+    {
+      errno = dir->error;
+      opendir_error (dir->path);
+    }
+  else if (dir->replaced)
+    error (0, 0, _("%s: directory replaced while being read"),
+	   quotearg_colon (dir->path));
+
+  if (stack_size == stack_alloc)
+    stack = x2nrealloc (stack, &stack_alloc, sizeof stack[0]);
+  stack[stack_size].dir = dir;
+  stack[stack_size].next = 0;
+  stack_size++;
+
+  for (i = 0; i < dir->count; i++)
+    {
+      struct walk_entry *e = &dir->entries[i];
+
+      if (e->stat_errno || !S_ISDIR (e->st.st_mode))
+	continue;
+      if (is_ancestor (&e->st))
+	{
+	  e->loop = true;
+	  continue;
+	}
+      e->dir = new_dir (entry_path (dir->path, e->name), dir, &e->st);
+      e->dir->prev = last;
+      if (last)
+	last->next = e->dir;
+      else
+	first = e->dir;
+      last = e->dir;
+    }
+  if (first)
+    queue_push (first, last);
+}
+
+/* Return the file NAME, described by ST, to the caller in BUF, and
+   free NAME.  */
+static char *
+return_name (dynamic_string *buf, char *name, struct stat const *st)
+{
+  remember_input_stat (name, st);
+  ds_reset (buf, 0);
+  ds_concat (buf, name);
+  free (name);
+  return buf->ds_string;
+}
+
+/* Get the next name of the files found under the directories given
+   with --walk into NAME.  Return NULL when all of them have been
+   returned.  */
+char *
+walk_next_name (dynamic_string *name)
+{
+  if (!walk_started)
+    walk_start ();
+
+  for (;;)
+    {
+      struct walk_frame *frame;
+      struct walk_entry *e;
+      char *path;
+
+      if (pending_dir)
+	{
+	  push_dir (pending_dir);
+	  pending_dir = NULL;
+	}
+
+      if (stack_size == 0)
+	{
+	  char const *root;
+	  struct stat st;
+
+	  if (next_root == walk_dir_count)
+	    {
+	      if (walkers)
+		walk_stop ();
+	      return NULL;
+	    }
+	  root = walk_dirs[next_root++];
+	  if (cpio_fstatat (AT_FDCWD, root, &st))
+	    {
+	      stat_error (root);
+	      continue;
+	    }
+	  if (S_ISDIR (st.st_mode))
+	    {
+	      pending_dir = new_dir (xstrdup (root), NULL, &st);
+	      queue_push (pending_dir, pending_dir);
+	    }
+	  return return_name (name, xstrdup (root), &st);
+	}
+
+      frame = &stack[stack_size - 1];
+      if (frame->next == frame->dir->count)
+	{
+	  free_dir (frame->dir);
+	  stack_size--;
+	  continue;
+	}
+
+      e = &frame->dir->entries[frame->next++];
+      path = entry_path (frame->dir->path, e->name);
+      if (e->stat_errno)
+	{
+	  errno = e->stat_errno;
+	  stat_error (path);
+	  free (path);
+	  continue;
+	}
+      if (e->loop)
+	error (0, 0, _("%s: file system loop detected"), quotearg_colon (path));
+      pending_dir = e->dir;
+      return return_name (name, path, &e->st);
+    }
+}
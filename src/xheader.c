@@ -0,0 +1,365 @@
+/* xheader.c - extended headers of the newc and crc formats
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program.  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* The headers of the newc and crc formats have room for a fixed set of
+   attributes only, as numbers of 32 bits.  Others are stored in an
+   extended header, a member named CPIO_EXTENDED_NAME that comes right
+   before the member they describe (see cpio.h for its contents).
+   Readers that do not know about it extract it as a regular file.
+
+   With --extended-headers, copy-out mode writes one when the size, the
+   inode number of a file with several links, or the modification time
+   of a member do not fit in its header, and with --nanoseconds, when
+   the modification time has a fraction of a second.  The header then
+   holds 0 as the size, and the lower 32 bits of the other numbers.
+
+   With --sparse-map, copy-out mode stores the files that have holes as
+   their extents of data only, which the extended header maps back to
+   their place in the file.  */
+
+#include <system.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "filetypes.h"
+#include "cpiohdr.h"
+#include "extern.h"
+
+/* Room for the signature and the keywords of an extended header, with
+   their values, besides the extents of a sparse map.  */
+#define XHEADER_FIXED_SIZE 256
+
+/* Largest number of extents of a sparse map: a map takes at most two
+   numbers of 20 digits and their separators per extent, besides the
+   other keywords.  A file with more extents is stored whole.  */
+#define SPARSE_MAX_EXTENTS \
+  ((XHEADER_MAX_SIZE - XHEADER_FIXED_SIZE) / (2 * 21))
+
+/* Free the attributes of XH, and reset it.  */
+void
+xheader_free (struct xheader *xh)
+{
+  free (xh->sparse_map);
+  memset (xh, 0, sizeof *xh);
+}
+
+static void
+add_extent (struct xheader *xh, size_t *alloc, off_t offset, off_t size)
+{
+  if (xh->sparse_count == *alloc)
+    xh->sparse_map = x2nrealloc (xh->sparse_map, alloc,
+				 sizeof xh->sparse_map[0]);
+  xh->sparse_map[xh->sparse_count].offset = offset;
+  xh->sparse_map[xh->sparse_count].size = size;
+  xh->sparse_count++;
+}
+
+/* If the regular file NAME, open as FD and described by ST, has holes,
+   store the map of its data in XH and return true.  Return false if it
+   has none, if they cannot be found, or if there are too many of them
+   for an extended header: the file is then stored whole.
+   In either case, FD is left at its start.  */
+bool
+sparse_map_file (int fd, char const *name, struct stat const *st,
+		 struct xheader *xh)
+{
+#ifdef SEEK_HOLE
+  size_t alloc = 0;
+  off_t pos, data, hole;
+  bool ok = true;
+
+  /* Most files have no hole, which the first seek tells.  */
+  hole = lseek (fd, 0, SEEK_HOLE);
+  if (hole < 0)
+    return false;
+
+  xheader_free (xh);
+  if (hole < st->st_size)
+    for (pos = 0; pos < st->st_size; pos = hole)
+      {
+	data = lseek (fd, pos, SEEK_DATA);
+	if (data < 0)
+	  {
+	    /* ENXIO means that the rest of the file is a hole.  */
+	    ok = errno == ENXIO;
+	    break;
+	  }
+	if (data >= st->st_size)
+	  break;
+	if (xh->sparse_count == SPARSE_MAX_EXTENTS)
+	  {
+	    ok = false;
+	    break;
+	  }
+	hole = lseek (fd, data, SEEK_HOLE);
+	if (hole < 0)
+	  {
+	    ok = false;
+	    break;
+	  }
+	if (hole > st->st_size)
+	  hole = st->st_size;
+	add_extent (xh, &alloc, data, hole - data);
+      }
+  else
+    ok = false;
+  if (lseek (fd, 0, SEEK_SET) != 0)
+    error (PAXEXIT_FAILURE, errno, _("%s: cannot seek"), quote (name));
+  if (!ok)
+    {
+      xheader_free (xh);
+      return false;
+    }
+  xh->sparse = true;
+  xh->sparse_size = st->st_size;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Return the number of bytes of data of the sparse file mapped by XH.  */
+off_t
+sparse_data_size (struct xheader const *xh)
+{
+  off_t size = 0;
+  size_t i;
+
+  for (i = 0; i < xh->sparse_count; i++)
+    size += xh->sparse_map[i].size;
+  return size;
+}
+
+/* Return the contents of the extended header holding the attributes of
+   XH, and store its size in *SIZE.  */
+char *
+xheader_encode (struct xheader const *xh, size_t *size)
+{
+  /* Each number takes at most 20 digits and a separator.  */
+  size_t alloc = XHEADER_FIXED_SIZE + 2 * 21 * xh->sparse_count;
+  char *buf = xmalloc (alloc);
+  char *p = stpcpy (buf, CPIO_EXTENDED_SIGNATURE);
+  size_t i;
+
+  if (xh->has_size)
+    p += sprintf (p, "size=%jd\n", (intmax_t) xh->size);
+  if (xh->has_ino)
+    p += sprintf (p, "ino=%ju\n", xh->ino);
+  if (xh->has_mtime)
+    {
+      /* The fraction of a time before the epoch counts back from the
+	 next second, as in the decimal notation.  */
+      if (xh->mtime < 0 && xh->mtime_nsec)
+	p += sprintf (p, "mtime=-%ju.%09ld\n", - (uintmax_t) (xh->mtime + 1),
+		      1000000000 - xh->mtime_nsec);
+      else if (xh->mtime_nsec)
+	p += sprintf (p, "mtime=%jd.%09ld\n", (intmax_t) xh->mtime,
+		      xh->mtime_nsec);
+      else
+	p += sprintf (p, "mtime=%jd\n", (intmax_t) xh->mtime);
+    }
+  if (xh->sparse)
+    {
+      p += sprintf (p, "sparse.size=%jd\nsparse.map=",
+		    (intmax_t) xh->sparse_size);
+      for (i = 0; i < xh->sparse_count; i++)
+	p += sprintf (p, "%s%jd,%jd", i ? "," : "",
+		      (intmax_t) xh->sparse_map[i].offset,
+		      (intmax_t) xh->sparse_map[i].size);
+      *p++ = '\n';
+    }
+  *size = p - buf;
+  return buf;
+}
+
+/* Decode the decimal number at *PP into *V, and advance *PP past it.
+   Return false if there is none, or if it does not fit.  */
+static bool
+decode_umax (char **pp, uintmax_t *v)
+{
+  if (**pp < '0' || **pp > '9')
+    return false;
+  errno = 0;
+  *v = strtoumax (*pp, pp, 10);
+  return errno == 0;
+}
+
+static bool
+decode_number (char **pp, off_t *v)
+{
+  uintmax_t n;
+
+  if (!decode_umax (pp, &n))
+    return false;
+  *v = n;
+  return *v >= 0 && (uintmax_t) *v == n;
+}
+
+/* Decode the time at P, in seconds with an optional sign and fraction,
+   into *SEC and *NSEC.  */
+static bool
+decode_time (char *p, time_t *sec, long *nsec)
+{
+  bool negative = *p == '-';
+  uintmax_t n;
+  int digits = 0;
+
+  if (negative)
+    p++;
+  if (!decode_umax (&p, &n))
+    return false;
+  *sec = n;
+  if (*sec < 0 || (uintmax_t) *sec != n)
+    return false;
+  *nsec = 0;
+  if (*p == '.')
+    for (p++; *p >= '0' && *p <= '9'; p++, digits++)
+      if (digits < 9)
+	*nsec = *nsec * 10 + *p - '0';
+  for (; digits < 9; digits++)
+    *nsec *= 10;
+  if (negative)
+    {
+      *sec = - *sec;
+      if (*nsec)
+	{
+	  --*sec;
+	  *nsec = 1000000000 - *nsec;
+	}
+    }
+  return *p == '\0';
+}
+
+static bool
+decode_sparse_map (struct xheader *xh, char *p)
+{
+  size_t alloc = 0;
+  off_t offset, size;
+
+  free (xh->sparse_map);
+  xh->sparse_map = NULL;
+  xh->sparse_count = 0;
+  if (!*p)
+    return true;
+  for (;;)
+    {
+      if (!decode_number (&p, &offset) || *p++ != ','
+	  || !decode_number (&p, &size))
+	return false;
+      add_extent (xh, &alloc, offset, size);
+      if (!*p)
+	return true;
+      if (*p++ != ',')
+	return false;
+    }
+}
+
+/* Add the attributes held by the SIZE bytes of the extended header BUF
+   to XH.  BUF is modified.  Return false if it does not start with
+   CPIO_EXTENDED_SIGNATURE or is malformed.  */
+bool
+xheader_decode (struct xheader *xh, char *buf, size_t size)
+{
+  char *end = buf + size;
+  char *line, *eol, *value;
+  size_t sig = sizeof CPIO_EXTENDED_SIGNATURE - 1;
+
+  if (size < sig || memcmp (buf, CPIO_EXTENDED_SIGNATURE, sig) != 0)
+    return false;
+  for (line = buf + sig; line < end; line = eol + 1)
+    {
+      eol = memchr (line, '\n', end - line);
+      if (!eol)
+	return false;
+      *eol = '\0';
+      value = strchr (line, '=');
+      if (!value)
+	return false;
+      *value++ = '\0';
+      if (strcmp (line, "size") == 0)
+	{
+	  if (!decode_number (&value, &xh->size) || *value)
+	    return false;
+	  xh->has_size = true;
+	}
+      else if (strcmp (line, "ino") == 0)
+	{
+	  if (!decode_umax (&value, &xh->ino) || *value)
+	    return false;
+	  xh->has_ino = true;
+	}
+      else if (strcmp (line, "mtime") == 0)
+	{
+	  if (!decode_time (value, &xh->mtime, &xh->mtime_nsec))
+	    return false;
+	  xh->has_mtime = true;
+	}
+      else if (strcmp (line, "sparse.size") == 0)
+	{
+	  if (!decode_number (&value, &xh->sparse_size) || *value)
+	    return false;
+	  xh->sparse = true;
+	}
+      else if (strcmp (line, "sparse.map") == 0)
+	{
+	  if (!decode_sparse_map (xh, value))
+	    return false;
+	}
+    }
+  return true;
+}
+
+/* Give the member FILE_HDR the attributes of XH that replace those of
+   its header.  Then check that the sparse map of XH, if any, is that
+   of the member: it must be a regular file holding the data of the
+   extents, which must come in order within the size of the file.
+   Otherwise, warn and forget the map, so that the member is extracted
+   as stored.  */
+void
+xheader_apply (struct xheader *xh, struct cpio_file_stat *file_hdr)
+{
+  off_t pos = 0;
+  size_t i;
+
+  if (xh->has_size)
+    file_hdr->c_filesize = xh->size;
+  if (xh->has_ino)
+    file_hdr->c_ino = xh->ino;
+  if (xh->has_mtime)
+    {
+      file_hdr->c_mtime = xh->mtime;
+      file_hdr->c_mtime_nsec = xh->mtime_nsec;
+    }
+
+  if (!xh->sparse)
+    return;
+  for (i = 0; i < xh->sparse_count; i++)
+    {
+      struct sparse_extent const *e = &xh->sparse_map[i];
+
+      if (e->offset < pos || e->size > xh->sparse_size - e->offset)
+	break;
+      pos = e->offset + e->size;
+    }
+  if (i < xh->sparse_count || (file_hdr->c_mode & CP_IFMT) != CP_IFREG
+      || file_hdr->c_filesize != sparse_data_size (xh))
+    {
+      error (0, 0, _("%s: invalid sparse map ignored"),
+	     quote (file_hdr->c_name));
+      xheader_free (xh);
+    }
+}